@@ -38,6 +38,13 @@ double mig_move_time = 0;
 double avg_dist = 1;
 double bot_dist = 1;
 
+// The page fields below only exist when built with CLUSTER_ALGO
+#if CLUSTER_ALGO == 1
+
+// page_history, neighbor lists and the distance ranges are shared by all
+// scanner shards
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 // static double top_va = 2, bot_va = 1;
 // static double top_cyc = 2, bot_cyc = 1;
@@ -71,8 +78,8 @@ static double calc_distance(struct tmem_page *a, struct tmem_page *b) {
     // double x = 5;
     // printf("%f -> %f\n", (double)(a->va) - (double)(b->va), ABS((double)(a->va) - (double)(b->va)));
     double va_diff = ABS((double)(a->va) - (double)(b->va));
-    double cyc_diff = ABS((double)(a->cyc_accessed) - (double)(b->cyc_accessed));
-    double ip_diff = ABS((double)(a->ip) - (double)(b->ip));
+    double cyc_diff = ABS((double)(a->cold->cyc_accessed) - (double)(b->cold->cyc_accessed));
+    double ip_diff = ABS((double)(a->cold->ip) - (double)(b->cold->ip));
 
     // update ranges
     // top_va = update_top(top_va, va_diff);
@@ -114,7 +121,7 @@ static double calc_distance(struct tmem_page *a, struct tmem_page *b) {
 static void update_neighbors(struct tmem_page *old_page) {
     // cool neighbors
     for (uint32_t i = 0; i < MAX_NEIGHBORS; i++) {
-        old_page->neighbors[i].distance *= 1.01;
+        old_page->cold->neighbors[i].distance *= 1.01;
     }
 
     for (uint32_t i = 0; i < HISTORY_SIZE; i++) {
@@ -127,24 +134,24 @@ static void update_neighbors(struct tmem_page *old_page) {
         // Find empty spot or furthest distance neighbor O(MAX_NEIGHBORS)
         struct neighbor_page *furthest_neighbor = NULL;
         for (uint32_t j = 0; j < MAX_NEIGHBORS; j++) {
-            if (old_page->neighbors[j].page == cur_page) {
+            if (old_page->cold->neighbors[j].page == cur_page) {
                 // already a neighbor, update and continue
                 // LOG_DEBUG("Already a neighbor\n");
-                furthest_neighbor = &old_page->neighbors[j];
+                furthest_neighbor = &old_page->cold->neighbors[j];
                 furthest_neighbor->distance = 0;
                 break;
             }
-            if (old_page->neighbors[j].page == NULL) {  // empty spot
+            if (old_page->cold->neighbors[j].page == NULL) {  // empty spot
                 // LOG_DEBUG("Empty spot\n");
-                assert(old_page->neighbors[j].distance == 0);
-                assert(old_page->neighbors[j].time_diff == 0);
+                assert(old_page->cold->neighbors[j].distance == 0);
+                assert(old_page->cold->neighbors[j].time_diff == 0);
                 // printf("found empty spot\n");
-                furthest_neighbor = &old_page->neighbors[j];
+                furthest_neighbor = &old_page->cold->neighbors[j];
                 break;
             }
 
-            if (furthest_neighbor == NULL || old_page->neighbors[j].distance > furthest_neighbor->distance) {
-                furthest_neighbor = &old_page->neighbors[j];
+            if (furthest_neighbor == NULL || old_page->cold->neighbors[j].distance > furthest_neighbor->distance) {
+                furthest_neighbor = &old_page->cold->neighbors[j];
             }
         }
 
@@ -154,14 +161,14 @@ static void update_neighbors(struct tmem_page *old_page) {
             // printf("adding page\n");
             furthest_neighbor->page = cur_page;
             furthest_neighbor->distance = distance;
-            furthest_neighbor->time_diff = cur_page->cyc_accessed - old_page->cyc_accessed;
+            furthest_neighbor->time_diff = cur_page->cold->cyc_accessed - old_page->cold->cyc_accessed;
         }
         
     }
     // printf("Neighbors:\t");
     // for (uint32_t i = 0; i < MAX_NEIGHBORS; i++) {
-    //     if (old_page->neighbors[i].page != NULL)
-    //         printf("0x%lx, ", old_page->neighbors[i].page->va);
+    //     if (old_page->cold->neighbors[i].page != NULL)
+    //         printf("0x%lx, ", old_page->cold->neighbors[i].page->va);
     // }
     // printf("\n");
 }
@@ -170,6 +177,8 @@ void algo_add_page(struct tmem_page *page) {
     // update neighbors of oldest page to get furthest lookahead 
     // then replace it with the new page
 
+    pthread_mutex_lock(&history_lock);
+
     // find oldest page O(HISTORY_SIZE)
     struct tmem_page *old_page = page_history[page_his_idx];
     uint32_t old_idx = page_his_idx;
@@ -179,10 +188,11 @@ void algo_add_page(struct tmem_page *page) {
         // History not full yet, add page and return
         page_history[page_his_idx] = page;
         page_his_idx = (page_his_idx + 1) % HISTORY_SIZE;
+        pthread_mutex_unlock(&history_lock);
         return;
     }
     for (uint32_t i = 0; i < HISTORY_SIZE; i++) {
-        if (page_history[i]->cyc_accessed < old_page->cyc_accessed) {
+        if (page_history[i]->cold->cyc_accessed < old_page->cold->cyc_accessed) {
             old_idx = i;
             old_page = page_history[i];
         }
@@ -193,15 +203,15 @@ void algo_add_page(struct tmem_page *page) {
     update_neighbors(old_page);
 
     page_history[old_idx] = page;
-    
+    pthread_mutex_unlock(&history_lock);
 }
 
 // 29
 // static void record_sample(struct tmem_page *page) {
 //     struct pebs_rec p_rec = {
 //         .va = page->va, //8
-//         .ip = page->ip, //8
-//         .cyc = page->cyc_accessed, //8
+//         .ip = page->cold->ip, //8
+//         .cyc = page->cold->cyc_accessed, //8
 //         .cpu = 0, //4
 //         .evt = page->in_dram //1
 //     };
@@ -239,6 +249,7 @@ void algo_predict_pages(struct tmem_page *page, struct tmem_page **pred_pages, u
     double threshold = bot_dist;
 
 #if DFS_ALGO == 1
+    pthread_mutex_lock(&history_lock);
     // DFS
     uint64_t tot_time_diff = 0;
     struct tmem_page *cur_page = page;
@@ -248,14 +259,14 @@ void algo_predict_pages(struct tmem_page *page, struct tmem_page **pred_pages, u
         //     LOG_DEBUG("PRED: Depth=%u\n", d);
         // }
         for (uint32_t i = 0; i < MAX_NEIGHBORS; i++) {
-            if (cur_page->neighbors[i].distance != 0 && cur_page->neighbors[i].distance < threshold) {
+            if (cur_page->cold->neighbors[i].distance != 0 && cur_page->cold->neighbors[i].distance < threshold) {
                 // found close neighbor
-                if (closest_neighbor == NULL || cur_page->neighbors[i].distance < closest_neighbor->distance) {
-                    closest_neighbor = &page->neighbors[i];
+                if (closest_neighbor == NULL || cur_page->cold->neighbors[i].distance < closest_neighbor->distance) {
+                    closest_neighbor = &page->cold->neighbors[i];
                 }
-                if (cur_page->neighbors[i].time_diff + tot_time_diff > mig_move_time + mig_queue_time) {
+                if (cur_page->cold->neighbors[i].time_diff + tot_time_diff > mig_move_time + mig_queue_time) {
                     // Far enough into future to migrate
-                    pred_pages[(*idx)++] = cur_page->neighbors[i].page;
+                    pred_pages[(*idx)++] = cur_page->cold->neighbors[i].page;
                 }
             }
         }
@@ -263,7 +274,9 @@ void algo_predict_pages(struct tmem_page *page, struct tmem_page **pred_pages, u
         cur_page = closest_neighbor->page;
         tot_time_diff += closest_neighbor->time_diff;
     }
+    pthread_mutex_unlock(&history_lock);
 
 #endif
 
 }
+#endif
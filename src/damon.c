@@ -0,0 +1,230 @@
+#include <fcntl.h>
+
+#include "pebs.h"
+
+// DAMON through sysfs. A kdamond monitors this process's address space with
+// a "stat" scheme matching every region, so asking it to update the scheme's
+// tried regions returns the whole address space as regions with their
+// nr_accesses and age. Shard 0 does that every DAMON_READ_INTERVAL_MS and
+// walks the tracked pages in each region. A region's nr_accesses comes from
+// sampling one address, so a lazy chunk in an accessed region only gets its
+// page if pagemap shows memory faulted into the window
+#define DAMON_SYSFS "/sys/kernel/mm/damon/admin/kdamonds"
+#define DAMON_CTX DAMON_SYSFS "/0/contexts/0"
+#define DAMON_SCHEME DAMON_CTX "/schemes/0"
+
+struct damon_region {
+    uint64_t start, end;
+    uint32_t nr_accesses;
+    uint32_t age;
+};
+
+static struct {
+    bool ready;
+    struct damon_region *regions;
+    size_t nregions, cap;
+    size_t next;            // region being walked, nregions when done
+    uint64_t addr;          // next address in it
+    uint64_t last_read;     // ms
+    int pagemap_fd;
+} damon = { .pagemap_fd = -1 };
+
+static uint64_t now_ms(void) {
+    struct timespec ts = get_time();
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static bool damon_write(const char *path, const char *val) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror(path);
+        return false;
+    }
+    bool ok = fputs(val, fp) >= 0;
+    ok &= fclose(fp) == 0;
+    if (!ok) perror(path);
+    return ok;
+}
+
+static bool damon_write_u64(const char *path, uint64_t val) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lu", val);
+    return damon_write(path, buf);
+}
+
+static bool damon_read_u64(const char *path, uint64_t *val) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return false;
+    bool ok = fscanf(fp, "%lu", val) == 1;
+    fclose(fp);
+    return ok;
+}
+
+static bool damon_init(void) {
+    uint64_t nr;
+    if (!damon_read_u64(DAMON_SYSFS "/nr_kdamonds", &nr)) {
+        fprintf(stderr, "damon: no sysfs interface at %s\n", DAMON_SYSFS);
+        return false;
+    }
+    if (nr != 0) {
+        fprintf(stderr, "damon: kdamonds already set up by someone else, not touching them\n");
+        return false;
+    }
+
+    bool ok = damon_write_u64(DAMON_SYSFS "/nr_kdamonds", 1)
+        && damon_write_u64(DAMON_SYSFS "/0/contexts/nr_contexts", 1)
+        && damon_write(DAMON_CTX "/operations", "vaddr")
+        && damon_write_u64(DAMON_CTX "/monitoring_attrs/intervals/sample_us", DAMON_SAMPLE_US)
+        && damon_write_u64(DAMON_CTX "/monitoring_attrs/intervals/aggr_us", DAMON_AGGR_US)
+        && damon_write_u64(DAMON_CTX "/monitoring_attrs/intervals/update_us", DAMON_UPDATE_US)
+        && damon_write_u64(DAMON_CTX "/monitoring_attrs/nr_regions/min", DAMON_MIN_REGIONS)
+        && damon_write_u64(DAMON_CTX "/monitoring_attrs/nr_regions/max", DAMON_MAX_REGIONS)
+        && damon_write_u64(DAMON_CTX "/targets/nr_targets", 1)
+        && damon_write_u64(DAMON_CTX "/targets/0/pid_target", getpid())
+        && damon_write_u64(DAMON_CTX "/schemes/nr_schemes", 1)
+        && damon_write(DAMON_SCHEME "/action", "stat")
+        // Match every region
+        && damon_write_u64(DAMON_SCHEME "/access_pattern/sz/min", 0)
+        && damon_write_u64(DAMON_SCHEME "/access_pattern/sz/max", UINT64_MAX)
+        && damon_write_u64(DAMON_SCHEME "/access_pattern/nr_accesses/min", 0)
+        && damon_write_u64(DAMON_SCHEME "/access_pattern/nr_accesses/max", UINT32_MAX)
+        && damon_write_u64(DAMON_SCHEME "/access_pattern/age/min", 0)
+        && damon_write_u64(DAMON_SCHEME "/access_pattern/age/max", UINT32_MAX)
+        && damon_write(DAMON_SYSFS "/0/state", "on");
+    if (!ok) {
+        damon_write_u64(DAMON_SYSFS "/nr_kdamonds", 0);
+        return false;
+    }
+    // Present bits need no privileges, without them lazy chunks stay untracked
+    damon.pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+    if (damon.pagemap_fd < 0) perror("damon pagemap open");
+    damon.last_read = now_ms();
+    damon.ready = true;
+    return true;
+}
+
+// Have the kdamond dump its current regions and read them back
+static void damon_read_regions(void) {
+    damon.nregions = damon.next = 0;
+    if (!damon_write(DAMON_SYSFS "/0/state", "update_schemes_tried_regions")) return;
+
+    DIR *dir = opendir(DAMON_SCHEME "/tried_regions");
+    if (dir == NULL) {
+        perror("damon tried_regions");
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9') continue;
+
+        if (damon.nregions == damon.cap) {
+            size_t cap = damon.cap ? damon.cap * 2 : DAMON_MAX_REGIONS;
+            struct damon_region *regions = realloc(damon.regions, cap * sizeof(*regions));
+            if (regions == NULL) break;
+            damon.regions = regions;
+            damon.cap = cap;
+        }
+
+        char path[512];
+        uint64_t start, end, nr_accesses, age;
+        bool ok = true;
+        snprintf(path, sizeof(path), DAMON_SCHEME "/tried_regions/%s/start", ent->d_name);
+        ok &= damon_read_u64(path, &start);
+        snprintf(path, sizeof(path), DAMON_SCHEME "/tried_regions/%s/end", ent->d_name);
+        ok &= damon_read_u64(path, &end);
+        snprintf(path, sizeof(path), DAMON_SCHEME "/tried_regions/%s/nr_accesses", ent->d_name);
+        ok &= damon_read_u64(path, &nr_accesses);
+        snprintf(path, sizeof(path), DAMON_SCHEME "/tried_regions/%s/age", ent->d_name);
+        ok &= damon_read_u64(path, &age);
+        if (!ok || end <= start) continue;
+
+        damon.regions[damon.nregions++] = (struct damon_region) {
+            .start = start,
+            .end = end,
+            .nr_accesses = nr_accesses,
+            .age = age
+        };
+    }
+    closedir(dir);
+
+    if (damon.nregions != 0) damon.addr = damon.regions[0].start;
+    STAT_INC(pebs_stats.page_scans);
+}
+
+static uint32_t damon_poll(int shard, struct pebs_sample *batch, uint32_t max) {
+    if (shard != 0 || !damon.ready) return 0;
+
+    if (damon.next == damon.nregions) {
+        uint64_t now = now_ms();
+        if (now - damon.last_read < DAMON_READ_INTERVAL_MS) return 0;
+        damon.last_read = now;
+        damon_read_regions();
+    }
+
+    // One step per PAGE_SIZE window of the region, so each tracked page is
+    // seen once, DAMON_POLL_STEPS of them before the epoch is left
+    uint32_t n = 0, steps = 0;
+    epoch_enter();
+    while (damon.next < damon.nregions && n < max && steps++ < DAMON_POLL_STEPS) {
+        struct damon_region *r = &damon.regions[damon.next];
+        if (damon.addr >= r->end) {
+            if (++damon.next < damon.nregions) damon.addr = damon.regions[damon.next].start;
+            continue;
+        }
+        uint64_t addr = damon.addr;
+        damon.addr = (addr & PAGE_MASK) + PAGE_SIZE;
+
+        struct tmem_page *page = find_page_no_lock(addr);
+        if (page == NULL && r->nr_accesses != 0 && damon.pagemap_fd >= 0) {
+            // Faulted in chunks of a lazy range get their page now
+            uint64_t end = damon.addr < r->end ? damon.addr : r->end;
+            if (lazy_fault_in(damon.pagemap_fd, addr, end) != 0) page = find_page_no_lock(addr);
+        }
+        if (page == NULL) continue;
+
+        if (r->nr_accesses != 0) {
+            batch[n++] = (struct pebs_sample) {
+                .addr = page->va,
+                .ip = 0,
+                .time = rdtscp(),
+                .tid = 0,
+                .weight = 0,
+                .cpu_idx = 0,
+                .count = r->nr_accesses,
+                .evt = page_in_dram(page) ? DRAMREAD : REMREAD
+            };
+            STAT_INC(pebs_stats.scanned_accessed);
+        } else {
+            STAT_INC(pebs_stats.scanned_idle);
+            if (r->age >= DAMON_COLD_AGE && page_in_dram(page)) {
+                make_cold_request(page);
+            }
+        }
+    }
+    epoch_exit();
+    return n;
+}
+
+static void damon_wait(int shard, int timeout_ms) {
+    usleep(timeout_ms * 1000);
+}
+
+static void damon_teardown(void) {
+    if (!damon.ready) return;
+    damon.ready = false;
+    damon_write(DAMON_SYSFS "/0/state", "off");
+    damon_write_u64(DAMON_SYSFS "/nr_kdamonds", 0);
+    if (damon.pagemap_fd >= 0) close(damon.pagemap_fd);
+    damon.pagemap_fd = -1;
+    free(damon.regions);
+    damon.regions = NULL;
+    damon.nregions = damon.cap = damon.next = 0;
+}
+
+const struct sample_source damon_source = {
+    .name = "damon",
+    .init = damon_init,
+    .poll = damon_poll,
+    .wait = damon_wait,
+    .teardown = damon_teardown,
+};
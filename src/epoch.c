@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "epoch.h"
+
+// One record per reader thread, never freed. epoch is the global epoch the
+// thread saw when it entered, 0 while it's outside a read section
+struct epoch_rec {
+    _Atomic uint64_t epoch;
+    struct epoch_rec *next;
+} __attribute__((aligned(64)));
+
+static _Atomic uint64_t global_epoch = 1;
+static struct epoch_rec *_Atomic epoch_recs = NULL;
+static _Thread_local struct epoch_rec *my_rec = NULL;
+
+// Retired entries, oldest first, so their epochs never decrease
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_entry *limbo_head = NULL, *limbo_tail = NULL;
+
+static struct epoch_rec* epoch_register(void) {
+    struct epoch_rec *rec = calloc(1, sizeof(struct epoch_rec));
+    assert(rec != NULL);
+    rec->next = atomic_load(&epoch_recs);
+    while (!atomic_compare_exchange_weak(&epoch_recs, &rec->next, rec));
+    my_rec = rec;
+    return rec;
+}
+
+void epoch_enter(void) {
+    struct epoch_rec *rec = my_rec != NULL ? my_rec : epoch_register();
+    assert(atomic_load_explicit(&rec->epoch, memory_order_relaxed) == 0);
+    // seq_cst so the store is visible before anything the section reads
+    atomic_store(&rec->epoch, atomic_load(&global_epoch));
+}
+
+void epoch_exit(void) {
+    atomic_store_explicit(&my_rec->epoch, 0, memory_order_release);
+}
+
+void epoch_retire(struct epoch_entry *entry, void (*fn)(struct epoch_entry *entry)) {
+    entry->fn = fn;
+    entry->next = NULL;
+
+    pthread_mutex_lock(&limbo_lock);
+    // Readers that entered from here on can't reach the entry any more
+    entry->epoch = atomic_fetch_add(&global_epoch, 1);
+    if (limbo_tail != NULL) limbo_tail->next = entry;
+    else limbo_head = entry;
+    limbo_tail = entry;
+    pthread_mutex_unlock(&limbo_lock);
+
+    epoch_reclaim();
+}
+
+// epoch_retire for n entries unlinked together, one trip through limbo_lock
+void epoch_retire_batch(struct epoch_entry **entries, size_t n, void (*fn)(struct epoch_entry *entry)) {
+    if (n == 0) return;
+    for (size_t i = 0; i < n; i++) {
+        entries[i]->fn = fn;
+        entries[i]->next = i + 1 < n ? entries[i + 1] : NULL;
+    }
+
+    pthread_mutex_lock(&limbo_lock);
+    uint64_t epoch = atomic_fetch_add(&global_epoch, 1);
+    for (size_t i = 0; i < n; i++) entries[i]->epoch = epoch;
+    if (limbo_tail != NULL) limbo_tail->next = entries[0];
+    else limbo_head = entries[0];
+    limbo_tail = entries[n - 1];
+    pthread_mutex_unlock(&limbo_lock);
+
+    epoch_reclaim();
+}
+
+// Run the callbacks of every entry retired before the oldest active reader
+void epoch_reclaim(void) {
+    if (pthread_mutex_trylock(&limbo_lock) != 0) return;
+
+    uint64_t min = UINT64_MAX;
+    for (struct epoch_rec *rec = atomic_load(&epoch_recs); rec != NULL; rec = rec->next) {
+        uint64_t epoch = atomic_load(&rec->epoch);
+        if (epoch != 0 && epoch < min) min = epoch;
+    }
+
+    struct epoch_entry *done = limbo_head, *last = NULL;
+    while (limbo_head != NULL && limbo_head->epoch < min) {
+        last = limbo_head;
+        limbo_head = limbo_head->next;
+    }
+    if (limbo_head == NULL) limbo_tail = NULL;
+    pthread_mutex_unlock(&limbo_lock);
+
+    if (last == NULL) return;
+    last->next = NULL;
+    while (done != NULL) {
+        struct epoch_entry *next = done->next;
+        done->fn(done);
+        done = next;
+    }
+}
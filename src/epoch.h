@@ -0,0 +1,25 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Epoch based reclamation for structures read without locks. Readers wrap
+// every access in epoch_enter()/epoch_exit(), writers unlink an object and
+// hand it to epoch_retire(), and its callback runs once no reader that could
+// still see it is left. Readers don't nest. Entries are embedded in the
+// retired object so retiring never allocates
+struct epoch_entry {
+    struct epoch_entry *next;
+    uint64_t epoch;
+    void (*fn)(struct epoch_entry *entry);
+};
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(struct epoch_entry *entry, void (*fn)(struct epoch_entry *entry));
+void epoch_retire_batch(struct epoch_entry **entries, size_t n, void (*fn)(struct epoch_entry *entry));
+void epoch_reclaim(void);
+
+#endif
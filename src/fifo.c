@@ -1,5 +1,8 @@
 #include <pthread.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "tmem.h"
 #include "fifo.h"
@@ -19,12 +22,12 @@ void enqueue_fifo(struct fifo_list *queue, struct tmem_page *entry)
   //   LOG_DEBUG("enqueue_fifo(%p, %p) %lu\n", queue, entry, queue->numentries);
 
   pthread_mutex_lock(&(queue->list_lock));
-  assert(entry->list == NULL);
-  assert(entry->prev == NULL);
-  entry->next = queue->first;
+  assert(entry->cold->list == NULL);
+  assert(entry->cold->prev == NULL);
+  entry->cold->next = queue->first;
   if(queue->first != NULL) {
-    assert(queue->first->prev == NULL);
-    queue->first->prev = entry;
+    assert(queue->first->cold->prev == NULL);
+    queue->first->cold->prev = entry;
   } else {
     assert(queue->last == NULL);
     assert(queue->numentries == 0);
@@ -32,13 +35,21 @@ void enqueue_fifo(struct fifo_list *queue, struct tmem_page *entry)
   }
 
   queue->first = entry;
-  entry->list = queue;
+  entry->cold->list = queue;
   // queue->numentries++;
   __atomic_fetch_add(&queue->numentries, 1, __ATOMIC_RELEASE);
   pthread_mutex_unlock(&(queue->list_lock));
+
+  // Only pay for the syscall if a thread is sleeping in wait_fifo
+  __atomic_fetch_add(&queue->seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&queue->waiters, __ATOMIC_SEQ_CST) != 0) {
+    syscall(SYS_futex, &queue->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
 }
 
-struct tmem_page *dequeue_fifo(struct fifo_list *queue)
+// Also returns the page's generation as it was on the list, a caller that
+// looks at the page later can tell it was freed and recycled meanwhile
+struct tmem_page *dequeue_fifo_gen(struct fifo_list *queue, uint32_t *gen)
 {
   // Check atomic numentries first to not lock every time for empty queue
   if (__atomic_load_n(&queue->numentries, __ATOMIC_ACQUIRE) == 0) {
@@ -60,21 +71,23 @@ struct tmem_page *dequeue_fifo(struct fifo_list *queue)
   struct tmem_page *ret = queue->last;
 
   // pthread_mutex_lock(&ret->page_lock);
-  if (ret == NULL || ret->list != queue) {
+  if (ret == NULL || ret->cold->list != queue) {
     // pthread_mutex_unlock(&ret->page_lock);
     pthread_mutex_unlock(&queue->list_lock);
     return NULL;
   }
 
-  queue->last = ret->prev;
+  queue->last = ret->cold->prev;
   if(queue->last != NULL) {
-    queue->last->next = NULL;
+    queue->last->cold->next = NULL;
   } else {
     queue->first = NULL;
   }
 
-  ret->prev = ret->next = NULL;
-  ret->list = NULL;
+  ret->cold->prev = ret->cold->next = NULL;
+  ret->cold->list = NULL;
+  // Queued pages aren't free, so the page isn't recycled before this
+  if (gen != NULL) *gen = page_state(ret) & PAGE_GEN_MASK;
   assert(queue->numentries > 0);
   // queue->numentries--;
   __atomic_fetch_sub(&queue->numentries, 1, __ATOMIC_RELEASE);
@@ -86,7 +99,13 @@ struct tmem_page *dequeue_fifo(struct fifo_list *queue)
   return ret;
 }
 
-void page_list_remove_page(struct fifo_list *list, struct tmem_page *page)
+struct tmem_page *dequeue_fifo(struct fifo_list *queue)
+{
+  return dequeue_fifo_gen(queue, NULL);
+}
+
+// Returns false if the page wasn't on the list
+bool page_list_remove_page(struct fifo_list *list, struct tmem_page *page)
 {
   // if (list == &hot_list) {
   //   LOG_DEBUG("  page_list_remove_page(hot, %p) %lu\n", page, list->numentries);
@@ -101,42 +120,64 @@ void page_list_remove_page(struct fifo_list *list, struct tmem_page *page)
   //   LOG_DEBUG("  page_list_remove_page(%p, %p) %lu\n", list, page, list->numentries);
 
   pthread_mutex_lock(&(list->list_lock));
-  if (page->list != list) {
+  if (page->cold->list != list) {
     pthread_mutex_unlock(&list->list_lock);
-    return;
+    return false;
   }
   if (list->first == NULL) {
     assert(list->last == NULL);
     assert(list->numentries == 0);
     pthread_mutex_unlock(&(list->list_lock));
     LOG_DEBUG("page_list_remove_page: list was empty!\n");
-    return;
+    return false;
   }
 
   if (list->first == page) {
-    list->first = page->next;
+    list->first = page->cold->next;
   }
 
   if (list->last == page) {
-    list->last = page->prev;
+    list->last = page->cold->prev;
   }
 
-  if (page->next != NULL) {
-    page->next->prev = page->prev;
+  if (page->cold->next != NULL) {
+    page->cold->next->cold->prev = page->cold->prev;
   }
 
-  if (page->prev != NULL) {
-    page->prev->next = page->next;
+  if (page->cold->prev != NULL) {
+    page->cold->prev->cold->next = page->cold->next;
   }
 
   assert(list->numentries > 0);
   // list->numentries--;
   __atomic_fetch_sub(&list->numentries, 1, __ATOMIC_RELEASE);
 
-  page->next = NULL;
-  page->prev = NULL;
-  page->list = NULL;
+  page->cold->next = NULL;
+  page->cold->prev = NULL;
+  page->cold->list = NULL;
   pthread_mutex_unlock(&(list->list_lock));
+  return true;
+}
+
+// Sleep until something is enqueued or timeout_ms passes.
+// Returns false if the list already had entries and no sleep happened
+bool wait_fifo(struct fifo_list *list, int timeout_ms)
+{
+  struct timespec timeout = {
+    .tv_sec = timeout_ms / 1000,
+    .tv_nsec = (timeout_ms % 1000) * 1000000L
+  };
+  bool slept = false;
+
+  __atomic_fetch_add(&list->waiters, 1, __ATOMIC_SEQ_CST);
+  uint32_t seq = __atomic_load_n(&list->seq, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&list->numentries, __ATOMIC_SEQ_CST) == 0) {
+    // Returns right away if an enqueue bumped seq since it was read
+    syscall(SYS_futex, &list->seq, FUTEX_WAIT_PRIVATE, seq, &timeout, NULL, 0);
+    slept = true;
+  }
+  __atomic_fetch_sub(&list->waiters, 1, __ATOMIC_SEQ_CST);
+  return slept;
 }
 
 void next_page(struct fifo_list *list, struct tmem_page *page, struct tmem_page **next_page)
@@ -150,8 +191,8 @@ void next_page(struct fifo_list *list, struct tmem_page *page, struct tmem_page
         *next_page = list->last;
     }
     else {
-        *next_page = page->prev;
-        assert(page->list == list);
+        *next_page = page->cold->prev;
+        assert(page->cold->list == list);
     }
     pthread_mutex_unlock(&(list->list_lock));
 }
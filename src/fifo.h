@@ -13,13 +13,17 @@ struct fifo_list {
   struct tmem_page *first, *last;
   pthread_mutex_t list_lock;
   size_t numentries;
+  uint32_t seq;       // bumped on every enqueue, futex word for wait_fifo
+  uint32_t waiters;
 };
 
 
 void enqueue_fifo(struct fifo_list *list, struct tmem_page *page);
 struct tmem_page* dequeue_fifo(struct fifo_list *list);
-void page_list_remove_page(struct fifo_list *list, struct tmem_page *page);
+struct tmem_page* dequeue_fifo_gen(struct fifo_list *list, uint32_t *gen);
+bool page_list_remove_page(struct fifo_list *list, struct tmem_page *page);
 void next_page(struct fifo_list *list, struct tmem_page *page, struct tmem_page **res);
+bool wait_fifo(struct fifo_list *list, int timeout_ms);
 
 #endif
 
@@ -0,0 +1,163 @@
+#include "pebs.h"
+
+#if TMEM_FINE == 1
+// Base page tracking. Pages stay the unit of the lists and the state word,
+// but each one also keeps a saturating sample count per base page and a
+// bitmap of which base pages are in DRAM. Promoting a page moves only its
+// hot base pages (FINE_HOT_THRESHOLD samples or more) with move_pages,
+// demoting it moves whatever of it is in DRAM, and dram_used follows the
+// bitmap instead of the page size. A page already in DRAM whose remote base
+// page gets hot is marked pending so a hot request queues it again and the
+// migrate thread tops it up.
+//
+// The bitmap is only changed by the migrate thread while it holds the page
+// PAGE_MIGRATING, by madvise dropping the page's memory while it holds it
+// PAGE_BUSY, and before the page is published. Scanners
+// only read it to set pending, a stale bit costs at most an extra top-up.
+// Counts are bumped by every scanner shard without a CAS, racing shards
+// only lose a count.
+//
+// Tracked mappings are madvised MADV_NOHUGEPAGE (tmem_track), a THP would
+// go to move_pages as a whole and its other base pages would be where the
+// bitmap doesn't say
+
+static inline bool fine_in_dram(struct tmem_fine *fine, uint64_t i) {
+    return fine->dram[i / 64] & (1UL << (i % 64));
+}
+
+static inline uint64_t fine_nr_pages(struct tmem_page *page) {
+    return page->size / BASE_PAGE_SIZE;
+}
+
+// Called before the page is published, where it was placed decides where
+// its base pages are
+void fine_setup(struct tmem_page *page, bool rem) {
+    struct tmem_fine *fine = &page->cold->fine;
+    memset(fine->counts, 0, sizeof(fine->counts));
+    memset(fine->dram, 0, sizeof(fine->dram));
+    fine->pending = false;
+    if (rem) return;
+    for (uint64_t i = 0; i < fine_nr_pages(page); i++) {
+        fine->dram[i / 64] |= 1UL << (i % 64);
+    }
+}
+
+// The piece of src starting first base pages into it keeps their counts
+// and tiers. Called before dst is published
+void fine_copy(struct tmem_page *dst, struct tmem_page *src, uint64_t first) {
+    struct tmem_fine *fine = &dst->cold->fine;
+    fine_setup(dst, true);
+    for (uint64_t i = 0; i < fine_nr_pages(dst); i++) {
+        fine->counts[i] = src->cold->fine.counts[first + i];
+        if (fine_in_dram(&src->cold->fine, first + i)) fine->dram[i / 64] |= 1UL << (i % 64);
+    }
+}
+
+// What the page counts for in dram_used
+uint64_t fine_dram_bytes(struct tmem_page *page) {
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < FINE_WORDS; i++) n += __builtin_popcountl(page->cold->fine.dram[i]);
+    return n * BASE_PAGE_SIZE;
+}
+
+void fine_touch(struct tmem_page *page, uint64_t addr, uint64_t count) {
+    uint64_t i = (addr - (uint64_t)page->va_start) / BASE_PAGE_SIZE;
+    if (i >= fine_nr_pages(page)) return;
+
+    struct tmem_fine *fine = &page->cold->fine;
+    uint64_t c = __atomic_load_n(&fine->counts[i], __ATOMIC_RELAXED) + count;
+    if (c > UINT8_MAX) c = UINT8_MAX;
+    __atomic_store_n(&fine->counts[i], (uint8_t)c, __ATOMIC_RELAXED);
+
+    if (c >= FINE_HOT_THRESHOLD && !fine_in_dram(fine, i) && page_in_dram(page)
+        && !__atomic_load_n(&fine->pending, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&fine->pending, true, __ATOMIC_RELEASE);
+    }
+}
+
+// Same rescale page_touch does to the page's counters, by whichever shard claimed it
+void fine_cool(struct tmem_page *page, int shift) {
+    struct tmem_fine *fine = &page->cold->fine;
+    for (uint64_t i = 0; i < fine_nr_pages(page); i++) {
+        uint64_t c = __atomic_load_n(&fine->counts[i], __ATOMIC_RELAXED);
+        if (c == 0) continue;
+        if (shift >= 8) c = 0;
+        else if (shift >= 0) c >>= shift;
+        else if (-shift >= 8) c = UINT8_MAX;
+        else c = c << -shift > UINT8_MAX ? UINT8_MAX : c << -shift;
+        __atomic_store_n(&fine->counts[i], (uint8_t)c, __ATOMIC_RELAXED);
+    }
+}
+
+// DRAM a promotion of the page would take right now
+uint64_t fine_promote_bytes(struct tmem_page *page) {
+    struct tmem_fine *fine = &page->cold->fine;
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < fine_nr_pages(page); i++) {
+        if (!fine_in_dram(fine, i) && __atomic_load_n(&fine->counts[i], __ATOMIC_RELAXED) >= FINE_HOT_THRESHOLD) n++;
+    }
+    return n * BASE_PAGE_SIZE;
+}
+
+// Moves the page's hot base pages to DRAM_NODE, or all of its DRAM base
+// pages to REM_NODE, adding the bytes that moved in or out of DRAM to
+// *bytes. Returns false if there was something to move and none of it
+// did, the page then stays in its tier. Call holding the page
+// PAGE_MIGRATING
+bool fine_migrate(struct tmem_page *page, int node, uint64_t *bytes) {
+    struct tmem_fine *fine = &page->cold->fine;
+    void *addrs[FINE_PAGES];
+    int nodes[FINE_PAGES], status[FINE_PAGES];
+    uint64_t idx[FINE_PAGES];
+    unsigned long n = 0;
+    bool up = node == DRAM_NODE;
+
+    // Base pages that get hot from here on set it again
+    if (up) __atomic_store_n(&fine->pending, false, __ATOMIC_RELEASE);
+
+    for (uint64_t i = 0; i < fine_nr_pages(page); i++) {
+        bool take = up ? !fine_in_dram(fine, i) && __atomic_load_n(&fine->counts[i], __ATOMIC_RELAXED) >= FINE_HOT_THRESHOLD
+                       : fine_in_dram(fine, i);
+        if (!take) continue;
+        addrs[n] = page->va_start + i * BASE_PAGE_SIZE;
+        nodes[n] = node;
+        status[n] = 0;
+        idx[n++] = i;
+    }
+
+    if (!up) {
+        // Base pages faulted in later land in remote memory with the rest
+        unsigned long rem_nodemask = 1UL << REM_NODE;
+        if (mbind(page->va_start, page->size, MPOL_BIND, &rem_nodemask, 64, 0) == -1) {
+            perror("mbind");
+        }
+    }
+    *bytes = 0;
+    if (n == 0) return true;
+
+    if (move_pages(0, n, addrs, nodes, status, MPOL_MF_MOVE) == -1) {
+        perror("move_pages");
+        n = 0;
+    }
+
+    uint64_t moved = 0;
+    for (unsigned long j = 0; j < n; j++) {
+        // Never faulted in takes no DRAM, so a demotion can drop it too
+        bool done = status[j] == node || (!up && status[j] == -ENOENT);
+        if (!done) continue;
+        if (up) fine->dram[idx[j] / 64] |= 1UL << (idx[j] % 64);
+        else fine->dram[idx[j] / 64] &= ~(1UL << (idx[j] % 64));
+        moved++;
+    }
+    if (moved == 0) {
+        // A DRAM page still wants its hot base pages, the next hot request
+        // queues it again
+        if (up && page_in_dram(page)) __atomic_store_n(&fine->pending, true, __ATOMIC_RELEASE);
+        return false;
+    }
+    if (up) __atomic_fetch_add(&pebs_stats.fine_promotions, moved, __ATOMIC_RELAXED);
+    else __atomic_fetch_add(&pebs_stats.fine_demotions, moved, __ATOMIC_RELAXED);
+    *bytes = moved * BASE_PAGE_SIZE;
+    return true;
+}
+#endif
@@ -0,0 +1,370 @@
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
+
+#include "pebs.h"
+
+// Hinting faults, like NUMA balancing but with libtmem's own policy. Shard 0
+// registers the next tracked pages in turn with a userfaultfd and write
+// protects them. The first write to one blocks the writer and queues a fault
+// message, shard 0 reads it, records the fault address, thread and time in
+// the page's slot and lifts the protection, which wakes the writer. The
+// kernel's own accesses (futex, copy_to_user, ...) fault the same way rather
+// than failing with EFAULT. A page nobody writes before HINT_ARM_TIMEOUT_MS
+// is taken as unused. Reads don't fault, so only writes are seen. Chunks of
+// lazy ranges have no page to arm until they get one, every time the pages
+// come round the next TMEM_LAZY_SCAN of them are checked in pagemap for
+// memory faulted in.
+//
+// Slots go FREE -> ARMING -> ARMED -> FIRING -> FIRED -> FREE. Shard 0 arms
+// slots and frees fired ones; shard 0 handling a fault or the timeout, and
+// tmem_untrack for memory going away, claim ARMED -> FIRING with a CAS, so
+// the protection is lifted once. A slot holds the page's generation as well,
+// a page freed and recycled since it was armed is never taken for it.
+enum { HINT_FREE, HINT_ARMING, HINT_ARMED, HINT_FIRING, HINT_FIRED };
+
+// Older headers don't have it, the kernel says whether it's there
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+
+#define HINT_MSGS 64    // fault messages read at once
+
+struct hint_slot {
+    _Atomic uint8_t state;
+    uint8_t evt;
+    uint64_t start, size;
+    struct tmem_page *page;
+    uint32_t gen;               // page's PAGE_GEN_MASK bits when armed
+    uint64_t armed_ms;
+    // Filled in when the slot fires
+    uint64_t addr, time;
+    uint32_t tid;
+};
+
+static struct {
+    bool ready;
+    int uffd;
+    struct hint_slot slots[HINT_MAX_ARMED];
+    _Atomic uint32_t narmed;
+    uint64_t *pages;            // snapshot the armed pages rotate through
+    size_t npages, cap, next;
+    uint64_t last_arm_ms;
+    int pagemap_fd;
+    uint64_t lazy_next;         // lazy_scan cursor
+} hint = { .uffd = -1, .pagemap_fd = -1 };
+
+static uint64_t now_ms(void) {
+    struct timespec ts = get_time();
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// Lifts the protection, which wakes anyone blocked writing to the range,
+// and unregisters it. The range may be gone already, that's fine
+static void hint_disarm(uint64_t start, uint64_t size) {
+    struct uffdio_writeprotect wp = { .range = { start, size }, .mode = 0 };
+    if (ioctl(hint.uffd, UFFDIO_WRITEPROTECT, &wp) != 0) {
+        struct uffdio_range wake = { start, size };
+        ioctl(hint.uffd, UFFDIO_WAKE, &wake);
+    }
+    struct uffdio_range range = { start, size };
+    ioctl(hint.uffd, UFFDIO_UNREGISTER, &range);
+}
+
+// Lift the page's protection and record the access. Caller moved the slot
+// from ARMED to FIRING
+static void hint_fire(struct hint_slot *slot, uint64_t addr, uint32_t tid) {
+    slot->addr = addr;
+    slot->time = rdtscp();
+    slot->tid = tid;
+    hint_disarm(slot->start, slot->size);
+    atomic_store_explicit(&slot->state, HINT_FIRED, memory_order_release);
+}
+
+static void hint_fault(uint64_t addr, uint32_t tid) {
+    for (int i = 0; i < HINT_MAX_ARMED; i++) {
+        struct hint_slot *slot = &hint.slots[i];
+        uint8_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+        if (state != HINT_ARMED) continue;
+        if (addr < slot->start || addr >= slot->start + slot->size) continue;
+        if (atomic_compare_exchange_strong(&slot->state, &state, HINT_FIRING)) {
+            hint_fire(slot, addr, tid);
+            return;
+        }
+    }
+    // Disarmed meanwhile, which woke the writer already. Wake it anyway in
+    // case what's left of a protection outlived its slot
+    hint_disarm(addr & BASE_PAGE_MASK, BASE_PAGE_SIZE);
+}
+
+// Called from tmem_untrack once the pages of [start, end) are freed, so
+// nothing arms them anymore. Slots still armed there are disarmed before
+// the memory is unmapped or reused
+void hint_untrack(uint64_t start, uint64_t end) {
+    if (!hint.ready || atomic_load_explicit(&hint.narmed, memory_order_acquire) == 0) return;
+
+    for (int i = 0; i < HINT_MAX_ARMED; i++) {
+        struct hint_slot *slot = &hint.slots[i];
+        uint8_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+        if (state != HINT_ARMED) continue;
+        if (end <= slot->start || start >= slot->start + slot->size) continue;
+        if (atomic_compare_exchange_strong(&slot->state, &state, HINT_FIRING)) {
+            hint_disarm(slot->start, slot->size);
+            atomic_fetch_sub(&hint.narmed, 1);
+            atomic_store_explicit(&slot->state, HINT_FREE, memory_order_release);
+        }
+    }
+}
+
+// Opens a userfaultfd and sets its API, api->features comes back as what
+// the kernel supports
+static int hint_open(struct uffdio_api *api) {
+    int fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) {
+        // Unprivileged processes may still have access to the device
+        int dev = open("/dev/userfaultfd", O_RDWR | O_CLOEXEC);
+        if (dev == -1) return -1;
+        fd = ioctl(dev, USERFAULTFD_IOC_NEW, O_CLOEXEC | O_NONBLOCK);
+        close(dev);
+        if (fd == -1) return -1;
+    }
+    if (ioctl(fd, UFFDIO_API, api) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool hint_init(void) {
+    // The API can only be set once per descriptor, ask what's there on a throwaway one
+    struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+    int probe = hint_open(&api);
+    if (probe == -1) {
+        perror("hint userfaultfd (needs CAP_SYS_PTRACE or vm.unprivileged_userfaultfd)");
+        return false;
+    }
+    close(probe);
+
+    uint64_t want = UFFD_FEATURE_PAGEFAULT_FLAG_WP | UFFD_FEATURE_THREAD_ID;
+    if ((api.features & want) != want) {
+        fprintf(stderr, "hint: userfaultfd write protection not supported\n");
+        return false;
+    }
+    // A page's never touched base pages fault too
+    if (api.features & UFFD_FEATURE_WP_UNPOPULATED) want |= UFFD_FEATURE_WP_UNPOPULATED;
+
+    api = (struct uffdio_api) { .api = UFFD_API, .features = want };
+    hint.uffd = hint_open(&api);
+    if (hint.uffd == -1) {
+        perror("hint userfaultfd");
+        return false;
+    }
+    // Present bits need no privileges, without them lazy chunks are never armed
+    hint.pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+    if (hint.pagemap_fd < 0) perror("hint pagemap open");
+    hint.last_arm_ms = now_ms();
+    hint.ready = true;
+    return true;
+}
+
+static bool hint_page_armed(struct tmem_page *page, uint32_t gen) {
+    for (int i = 0; i < HINT_MAX_ARMED; i++) {
+        struct hint_slot *slot = &hint.slots[i];
+        if (atomic_load(&slot->state) != HINT_FREE && slot->page == page && slot->gen == gen) return true;
+    }
+    return false;
+}
+
+// Next tracked page that can be armed, going round the tracked pages in turn.
+// Call inside an epoch section
+static struct tmem_page* hint_next_page(void) {
+    for (size_t tries = 0; tries <= hint.npages; tries++) {
+        if (hint.next >= hint.npages) {
+            size_t n;
+            while ((n = snapshot_pages(hint.pages, hint.cap)) > hint.cap) {
+                size_t cap = n + n / 2;
+                uint64_t *pages = realloc(hint.pages, cap * sizeof(*pages));
+                if (pages == NULL) {
+                    perror("hint page snapshot");
+                    n = hint.cap;
+                    break;
+                }
+                hint.pages = pages;
+                hint.cap = cap;
+            }
+            hint.npages = n;
+            hint.next = 0;
+            if (n == 0) return NULL;
+        }
+        struct tmem_page *page = find_page_no_lock(hint.pages[hint.next++]);
+        // Nothing writes to a page that isn't writable
+        if (page == NULL || page_is_free(page) || !(page->cold->prot & PROT_WRITE) ||
+            hint_page_armed(page, page_state(page) & PAGE_GEN_MASK)) continue;
+        return page;
+    }
+    return NULL;
+}
+
+static bool hint_protect(uint64_t start, uint64_t size) {
+    struct uffdio_register reg = { .range = { start, size }, .mode = UFFDIO_REGISTER_MODE_WP };
+    if (ioctl(hint.uffd, UFFDIO_REGISTER, &reg) != 0) return false;
+    struct uffdio_writeprotect wp = { .range = { start, size }, .mode = UFFDIO_WRITEPROTECT_MODE_WP };
+    if (ioctl(hint.uffd, UFFDIO_WRITEPROTECT, &wp) != 0) {
+        ioctl(hint.uffd, UFFDIO_UNREGISTER, &reg.range);
+        return false;
+    }
+    return true;
+}
+
+static void hint_arm(uint64_t now) {
+    uint32_t quota = (uint64_t)HINT_FAULT_BUDGET * (now - hint.last_arm_ms) / 1000;
+    if (quota == 0) return;
+    hint.last_arm_ms = now;
+
+    // Before the pages come round again, lazy_scan enters the epoch itself
+    if (hint.next >= hint.npages && hint.pagemap_fd >= 0) {
+        lazy_scan(hint.pagemap_fd, &hint.lazy_next, TMEM_LAZY_SCAN);
+    }
+
+    epoch_enter();
+    for (int i = 0; i < HINT_MAX_ARMED && quota > 0; i++) {
+        struct hint_slot *slot = &hint.slots[i];
+        if (atomic_load_explicit(&slot->state, memory_order_acquire) != HINT_FREE) continue;
+
+        struct tmem_page *page = hint_next_page();
+        if (page == NULL) break;
+
+        // Holding the page busy keeps munmap from recycling the range while
+        // it's being armed, once it's armed tmem_untrack disarms it
+        uint32_t state;
+        if (!page_busy_begin(page, 0, &state)) continue;
+        slot->start = (uint64_t)page->va_start;
+        slot->size = page->size;
+        slot->page = page;
+        slot->gen = state & PAGE_GEN_MASK;
+        slot->evt = (state & PAGE_REM) ? REMREAD : DRAMREAD;
+        slot->armed_ms = now;
+        atomic_fetch_add(&hint.narmed, 1);
+        atomic_store_explicit(&slot->state, HINT_ARMING, memory_order_release);
+        if (!hint_protect(slot->start, slot->size)) {
+            atomic_store(&slot->state, HINT_FREE);
+            atomic_fetch_sub(&hint.narmed, 1);
+        } else {
+            atomic_store_explicit(&slot->state, HINT_ARMED, memory_order_release);
+            STAT_INC(pebs_stats.hint_armed);
+            quota--;
+        }
+        page_busy_end(page, state);
+    }
+    epoch_exit();
+}
+
+// Lift the protection of a page nobody wrote. tmem_untrack disarms slots of
+// memory going away, so the range still belongs to the page unless it was
+// freed right now, the generation tells. slot->page may have been recycled
+// since, it's only compared
+static void hint_expire(struct hint_slot *slot) {
+    epoch_enter();
+    struct tmem_page *page = find_page_no_lock(slot->start);
+    uint32_t state = 0;
+    bool same = false;
+    if (page == slot->page && page_busy_begin(page, 0, &state)) {
+        same = (state & PAGE_GEN_MASK) == slot->gen && (uint64_t)page->va_start == slot->start;
+        if (same) hint_disarm(slot->start, slot->size);
+        page_busy_end(page, state);
+    }
+
+    STAT_INC(pebs_stats.hint_timeouts);
+    if (same && !(state & PAGE_REM)) make_cold_request(page);
+    epoch_exit();
+}
+
+// Fault messages waiting on the userfaultfd
+static void hint_read_faults(void) {
+    struct uffd_msg msgs[HINT_MSGS];
+    ssize_t len;
+    while ((len = read(hint.uffd, msgs, sizeof(msgs))) > 0) {
+        for (size_t i = 0; i < len / sizeof(struct uffd_msg); i++) {
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) continue;
+            hint_fault(msgs[i].arg.pagefault.address, msgs[i].arg.pagefault.feat.ptid);
+        }
+    }
+}
+
+static uint32_t hint_poll(int shard, struct pebs_sample *batch, uint32_t max) {
+    if (shard != 0 || !hint.ready) return 0;
+
+    hint_read_faults();
+    uint64_t now = now_ms();
+    uint32_t n = 0;
+    for (int i = 0; i < HINT_MAX_ARMED && n < max; i++) {
+        struct hint_slot *slot = &hint.slots[i];
+        uint8_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+
+        if (state == HINT_FIRED) {
+            batch[n++] = (struct pebs_sample) {
+                .addr = slot->addr,
+                .ip = 0,
+                .time = slot->time,
+                .tid = slot->tid,
+                .weight = 0,
+                .cpu_idx = 0,
+                .evt = slot->evt
+            };
+            STAT_INC(pebs_stats.hint_faults);
+        } else if (state == HINT_ARMED && now - slot->armed_ms >= HINT_ARM_TIMEOUT_MS &&
+                   atomic_compare_exchange_strong(&slot->state, &state, HINT_FIRING)) {
+            hint_expire(slot);
+        } else {
+            continue;
+        }
+        atomic_fetch_sub(&hint.narmed, 1);
+        atomic_store_explicit(&slot->state, HINT_FREE, memory_order_release);
+    }
+    if (n != 0) return n;
+
+    if (now - hint.last_arm_ms >= HINT_SCAN_INTERVAL_MS) hint_arm(now);
+    return 0;
+}
+
+// Writers are blocked until shard 0 handles their fault, so it waits on the
+// userfaultfd rather than sleeping
+static void hint_wait(int shard, int timeout_ms) {
+    if (shard != 0 || !hint.ready) {
+        usleep(timeout_ms * 1000);
+        return;
+    }
+    struct pollfd pfd = { .fd = hint.uffd, .events = POLLIN };
+    poll(&pfd, 1, timeout_ms);
+}
+
+// Disarm everything still armed and close the userfaultfd, which wakes
+// anyone still blocked
+static void hint_teardown(void) {
+    if (!hint.ready) return;
+    for (int i = 0; i < HINT_MAX_ARMED; i++) {
+        struct hint_slot *slot = &hint.slots[i];
+        uint8_t state = HINT_ARMED;
+        if (atomic_compare_exchange_strong(&slot->state, &state, HINT_FIRING)) {
+            hint_disarm(slot->start, slot->size);
+        }
+        atomic_store(&slot->state, HINT_FREE);
+    }
+    atomic_store(&hint.narmed, 0);
+    hint.ready = false;
+    close(hint.uffd);
+    hint.uffd = -1;
+    if (hint.pagemap_fd >= 0) close(hint.pagemap_fd);
+    hint.pagemap_fd = -1;
+    free(hint.pages);
+    hint.pages = NULL;
+    hint.npages = hint.cap = hint.next = 0;
+}
+
+const struct sample_source hint_source = {
+    .name = "hint",
+    .init = hint_init,
+    .poll = hint_poll,
+    .wait = hint_wait,
+    .teardown = hint_teardown,
+};
@@ -0,0 +1,180 @@
+#include <fcntl.h>
+
+#include "pebs.h"
+
+// Access bit scanning with idle page tracking. Every IDLE_SCAN_INTERVAL_MS
+// shard 0 walks the tracked pages, looks up their frames in pagemap and tests
+// the frames' idle bits, then sets them again for the next scan. A page with
+// any frame touched since the last scan becomes one sample, a page in DRAM
+// that stays untouched for IDLE_COLD_SCANS scans is made cold. Chunks of lazy
+// ranges have no page to scan until something faults memory into them, each
+// scan first checks the next TMEM_LAZY_SCAN of them for that
+#define IDLE_PAGEMAP_ENTRIES (PAGE_SIZE / BASE_PAGE_SIZE)
+
+static struct {
+    int pagemap_fd, bitmap_fd;
+    uint64_t *pages;            // snapshot of the tracked pages for the current scan
+    size_t npages, cap;
+    size_t next;                // next page to scan, npages when no scan is running
+    uint64_t lazy_next;         // lazy_scan cursor
+    uint64_t last_scan;         // when the last scan started, ms
+    bool warned_pfn;
+    uint64_t entries[IDLE_PAGEMAP_ENTRIES];
+} idle;
+
+static uint64_t now_ms(void) {
+    struct timespec ts = get_time();
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static bool idle_init(void) {
+    idle.bitmap_fd = -1;
+    idle.pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+    if (idle.pagemap_fd < 0) {
+        perror("pagemap open");
+        return false;
+    }
+    idle.bitmap_fd = open("/sys/kernel/mm/page_idle/bitmap", O_RDWR);
+    if (idle.bitmap_fd < 0) {
+        perror("page_idle bitmap open");
+        close(idle.pagemap_fd);
+        idle.pagemap_fd = -1;
+        return false;
+    }
+    idle.next = idle.npages = 0;
+    return true;
+}
+
+// Snapshot the tracked pages. Only their addresses, a page unmapped while
+// the scan runs is just not found when its turn comes
+static void idle_scan_begin(void) {
+    lazy_scan(idle.pagemap_fd, &idle.lazy_next, TMEM_LAZY_SCAN);
+
+    size_t n;
+    while ((n = snapshot_pages(idle.pages, idle.cap)) > idle.cap) {
+        size_t cap = n + n / 2;
+        uint64_t *pages = realloc(idle.pages, cap * sizeof(*pages));
+        if (pages == NULL) {
+            perror("idle page snapshot");
+            n = idle.cap;
+            break;
+        }
+        idle.pages = pages;
+        idle.cap = cap;
+    }
+    idle.npages = n;
+    idle.next = 0;
+    idle.last_scan = now_ms();
+}
+
+// Test and set the idle bits of a page's frames. Returns true if any of
+// them was touched since the last scan. Frames that aren't present count as
+// idle, frames whose PFN is hidden count as touched so they never go cold
+static bool idle_page_accessed(struct tmem_page *page) {
+    uint64_t nframes = page->size / BASE_PAGE_SIZE;
+    if (nframes > IDLE_PAGEMAP_ENTRIES) nframes = IDLE_PAGEMAP_ENTRIES;
+
+    off_t off = ((uint64_t)page->va_start / BASE_PAGE_SIZE) * sizeof(uint64_t);
+    ssize_t got = pread(idle.pagemap_fd, idle.entries, nframes * sizeof(uint64_t), off);
+    if (got <= 0) return false;
+    nframes = got / sizeof(uint64_t);
+
+    bool accessed = false;
+    uint64_t word = 0, mask = 0;
+    int64_t word_idx = -1;
+    for (uint64_t i = 0; i <= nframes; i++) {
+        uint64_t pfn = 0;
+        if (i < nframes) {
+            if (!(idle.entries[i] & PAGEMAP_PRESENT)) continue;
+            pfn = idle.entries[i] & PAGEMAP_PFN_MASK;
+            if (pfn == 0) {
+                // Without CAP_SYS_ADMIN the kernel zeroes PFNs
+                if (!idle.warned_pfn) {
+                    fprintf(stderr, "idle: pagemap has no PFNs, idle scanning needs CAP_SYS_ADMIN\n");
+                    idle.warned_pfn = true;
+                }
+                return true;
+            }
+            if ((int64_t)(pfn / 64) == word_idx) {
+                mask |= 1ULL << (pfn % 64);
+                continue;
+            }
+        }
+
+        // Frames are mostly contiguous, so test and mark a bitmap word at a time
+        if (word_idx >= 0) {
+            off_t bit_off = word_idx * sizeof(uint64_t);
+            if (pread(idle.bitmap_fd, &word, sizeof(word), bit_off) == sizeof(word)) {
+                accessed |= (word & mask) != mask;
+            }
+            if (pwrite(idle.bitmap_fd, &mask, sizeof(mask), bit_off) != sizeof(mask)) {
+                accessed = true;
+            }
+        }
+        if (i < nframes) {
+            word_idx = pfn / 64;
+            mask = 1ULL << (pfn % 64);
+        }
+    }
+    return accessed;
+}
+
+static uint32_t idle_poll(int shard, struct pebs_sample *batch, uint32_t max) {
+    if (shard != 0 || idle.bitmap_fd < 0) return 0;
+
+    if (idle.next == idle.npages) {
+        if (now_ms() - idle.last_scan < IDLE_SCAN_INTERVAL_MS) return 0;
+        idle_scan_begin();
+    }
+
+    uint32_t n = 0;
+    epoch_enter();
+    while (idle.next < idle.npages && n < max) {
+        struct tmem_page *page = find_page_no_lock(idle.pages[idle.next++]);
+        if (page == NULL || page_is_free(page)) continue;
+
+        if (idle_page_accessed(page)) {
+            page->cold->idle_scans = 0;
+            batch[n++] = (struct pebs_sample) {
+                .addr = page->va,
+                .ip = 0,
+                .time = rdtscp(),
+                .tid = 0,
+                .weight = 0,
+                .cpu_idx = 0,
+                .evt = page_in_dram(page) ? DRAMREAD : REMREAD
+            };
+            STAT_INC(pebs_stats.scanned_accessed);
+        } else {
+            STAT_INC(pebs_stats.scanned_idle);
+            // Sampling can only guess at this, the scan knows the page went unused
+            if (++page->cold->idle_scans >= IDLE_COLD_SCANS && page_in_dram(page)) {
+                make_cold_request(page);
+            }
+        }
+    }
+    epoch_exit();
+    if (idle.next == idle.npages) STAT_INC(pebs_stats.page_scans);
+    return n;
+}
+
+static void idle_wait(int shard, int timeout_ms) {
+    usleep(timeout_ms * 1000);
+}
+
+static void idle_teardown(void) {
+    if (idle.pagemap_fd >= 0) close(idle.pagemap_fd);
+    if (idle.bitmap_fd >= 0) close(idle.bitmap_fd);
+    idle.pagemap_fd = idle.bitmap_fd = -1;
+    free(idle.pages);
+    idle.pages = NULL;
+    idle.npages = idle.cap = idle.next = 0;
+}
+
+const struct sample_source idle_source = {
+    .name = "idle",
+    .init = idle_init,
+    .poll = idle_poll,
+    .wait = idle_wait,
+    .teardown = idle_teardown,
+};
@@ -79,6 +79,17 @@ static int munmap_filter(void *addr, size_t length, uint64_t* result)
 }
 
 
+// mremap, madvise, mprotect and brk of the application are run by tmem
+// itself, so it only follows what the kernel actually did
+static bool tracked_call(void)
+{
+    if (main_pid == 0) {
+      main_pid = getpid();
+    }
+    return !internal_call && main_pid == getpid();
+}
+
+
 static void* bind_symbol(const char *sym)
 {
     void *ptr;
@@ -95,8 +106,24 @@ static int hook(long syscall_number, long arg0, long arg1, long arg2, long arg3,
       return mmap_filter((void*)arg0, (size_t)arg1, (int)arg2, (int)arg3, (int)arg4, (off_t)arg5, (uint64_t*)result);
     } else if (syscall_number == SYS_munmap){
       return munmap_filter((void*)arg0, (size_t)arg1, (uint64_t*)result);
-      } else {
-          // ignore non-mmap system calls
+    } else if (syscall_number == SYS_mremap) {
+      if (!tracked_call()) return 1;
+      *result = tmem_mremap((void*)arg0, (size_t)arg1, (size_t)arg2, (int)arg3, (void*)arg4);
+      return 0;
+    } else if (syscall_number == SYS_madvise && (arg2 == MADV_DONTNEED || arg2 == MADV_REMOVE)) {
+      if (!tracked_call()) return 1;
+      *result = tmem_madvise((void*)arg0, (size_t)arg1, (int)arg2);
+      return 0;
+    } else if (syscall_number == SYS_mprotect) {
+      if (!tracked_call()) return 1;
+      *result = tmem_mprotect((void*)arg0, (size_t)arg1, (int)arg2);
+      return 0;
+    } else if (syscall_number == SYS_brk) {
+      if (!tracked_call()) return 1;
+      *result = tmem_brk((void*)arg0);
+      return 0;
+    } else {
+      // ignore non-mmap system calls
       return 1;
     }
 }
@@ -125,6 +152,10 @@ static __attribute__((constructor)) void init(void)
 
     LOG_DEBUG("tmem_init\n");
     tmem_init();
+#if TMEM_MALLOC == 1
+    LOG_DEBUG("tmalloc_init\n");
+    tmalloc_init();
+#endif
     internal_call = false;
 
 //   int ret = mallopt(M_MMAP_THRESHOLD, 0);
@@ -8,30 +8,90 @@
 
 
 // Private variables
+// Slots are owned by shard (slot % PEBS_NSCANNERS). The rescan in shard 0
+// picks the cpu and sets want, only the owning shard opens or closes events
+struct pebs_cpu_slot {
+    _Atomic int cpu;        // -1 when the slot is free
+    _Atomic bool want;
+    bool active;            // events open
+};
+
+static struct pebs_cpu_slot pebs_cpus[PEBS_NPROCS];
 static int pfd[PEBS_NPROCS][NPBUFTYPES];
 static struct perf_event_mmap_page *perf_page[PEBS_NPROCS][NPBUFTYPES];
 static uint64_t no_samples[PEBS_NPROCS][NPBUFTYPES];
+static pid_t internal_tids[NUM_INTERNAL_THREADS];
+
+// Event config/config1 opened on every sampled cpu, and the pbuftype of its
+// samples (-1: classified per sample from data_src), indexed by ring
+static const struct {
+    __u64 config, config1;
+    int evt;
+} ring_config[PEBS_NRINGS] = {
+#if PEBS_DATA_SRC == 1
+    { 0x1cd, PEBS_LDLAT, -1 },          // MEM_TRANS_RETIRED.LOAD_LATENCY
+#else
+    { 0x1d3, 0, DRAMREAD },             // MEM_LOAD_L3_MISS_RETIRED.LOCAL_DRAM, mem_load_uops_l3_miss_retired.local_dram
+    { 0x4d3, 0, REMREAD },              // mem_load_uops_l3_miss_retired.remote_dram
+#endif
+#if PEBS_STORES == 1
+    { 0x82d0, 0, STOREWRITE },          // MEM_INST_RETIRED.ALL_STORES
+#endif
+};
+static pid_t tracked_pid;
+#if PEBS_PIPELINE == 1
+static ring_handle_t policy_rings[PEBS_NSCANNERS];
+#endif
 static FILE* tmem_trace_fp = NULL;
+#if SAMPLE_SOURCE == SOURCE_REPLAY
+static const struct sample_source *sample_source = &replay_source;
+#elif SAMPLE_SOURCE == SOURCE_IDLE
+static const struct sample_source *sample_source = &idle_source;
+#elif SAMPLE_SOURCE == SOURCE_HINT
+static const struct sample_source *sample_source = &hint_source;
+#elif SAMPLE_SOURCE == SOURCE_DAMON
+static const struct sample_source *sample_source = &damon_source;
+#else
+static const struct sample_source *sample_source = &pebs_source;
+#endif
 static _Atomic bool kill_internal_threads[NUM_INTERNAL_THREADS];
 static pthread_t internal_threads[NUM_INTERNAL_THREADS];
 
-static _Thread_local uint64_t last_cyc_cool;
+// Shared by all scanner shards so the cooling rate doesn't scale with shard count
+static _Atomic uint64_t last_cyc_cool;
+
+static _Atomic uint64_t global_clock = 0;
+
+// log2 of the current period relative to SAMPLE_PERIOD
+_Atomic int period_shift = 0;
+static _Atomic bool throttle_seen = false;
 
-static uint64_t global_clock = 0;
+// Pages remember the clock and period shift their access count is scaled to
+#define PAGE_STAMP(clock, shift) (((clock) << 8) | (uint8_t)((shift) + 128))
+#define STAMP_CLOCK(stamp) ((stamp) >> 8)
+#define STAMP_SHIFT(stamp) ((int)((stamp) & 0xff) - 128)
 
 
 struct perf_sample {
   __u64	ip;             /* if PERF_SAMPLE_IP*/
-//   __u32 pid, tid;       /* if PERF_SAMPLE_TID */
+  __u32 pid, tid;       /* if PERF_SAMPLE_TID */
   __u64 time;           /* if PERF_SAMPLE_TIME */
   __u64 addr;           /* if PERF_SAMPLE_ADDR */
-//   __u64 weight;         /* if PERF_SAMPLE_WEIGHT */
-// __u64 data_src;         /* if PERF_SAMPLE_DATA_SRC */
+#if PEBS_WEIGHTED_HOTNESS == 1
+  __u64 weight;         /* if PERF_SAMPLE_WEIGHT */
+#endif
+#if PEBS_DATA_SRC == 1
+  __u64 data_src;       /* if PERF_SAMPLE_DATA_SRC */
+#endif
 };
 
 
 
 struct pebs_stats pebs_stats = {0};
+struct pebs_shard_stats pebs_shard_stats[PEBS_NSCANNERS] = {0};
+
+#define PERF_SAMPLE_REC_SIZE (sizeof(struct perf_event_header) + sizeof(struct perf_sample))
+#define PERF_BOUNCE_SIZE 256
 
 
 void wait_for_threads() {
@@ -43,7 +103,7 @@ void wait_for_threads() {
 }
 
 void pebs_cleanup() {
-    
+    sample_source->teardown();
 }
 
 static inline void kill_thread(uint8_t thread) {
@@ -67,6 +127,11 @@ static inline long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
   return ret;
 }
 
+static inline uint64_t period_from_shift(int shift) {
+    uint64_t period = shift >= 0 ? (uint64_t)SAMPLE_PERIOD << shift : (uint64_t)SAMPLE_PERIOD >> -shift;
+    return period == 0 ? 1 : period;
+}
+
 static struct perf_event_mmap_page* perf_setup(__u64 config, __u64 config1, uint32_t cpu_idx, __u64 cpu, __u64 type) {
     struct perf_event_attr attr = {0};
 
@@ -75,36 +140,282 @@ static struct perf_event_mmap_page* perf_setup(__u64 config, __u64 config1, uint
 
     attr.config = config;
     attr.config1 = config1;
-    attr.sample_period = SAMPLE_PERIOD;
+    attr.sample_period = period_from_shift(atomic_load(&period_shift));
 
-    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR; // PERF_SAMPLE_TID, PERF_SAMPLE_WEIGHT
+    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR;
+#if PEBS_WEIGHTED_HOTNESS == 1
+    attr.sample_type |= PERF_SAMPLE_WEIGHT;
+#endif
+#if PEBS_DATA_SRC == 1
+    attr.sample_type |= PERF_SAMPLE_DATA_SRC;
+#endif
     attr.disabled = 0;
-    //attr.inherit = 1;
+#if PEBS_TASK_MODE == 1
+    // Threads the application creates from here on are counted too
+    attr.inherit = 1;
+    pid_t pid = tracked_pid;
+#else
+    pid_t pid = -1;
+#endif
     attr.exclude_kernel = 1;
     attr.exclude_hv = 1;
     attr.exclude_callchain_kernel = 1;
     attr.exclude_callchain_user = 1;
     attr.precise_ip = 1;
+#if PEBS_BLOCKING == 1
+    attr.wakeup_events = PEBS_WAKEUP_EVENTS;
+#endif
     
-    pfd[cpu_idx][type] = perf_event_open(&attr, -1, cpu, -1, 0);
-    assert(pfd[cpu_idx][type] != -1);
+    pfd[cpu_idx][type] = perf_event_open(&attr, pid, cpu, -1, 0);
+    if (pfd[cpu_idx][type] == -1) {
+        // cpu can go offline between discovery and setup
+        perror("perf_event_open");
+        return NULL;
+    }
 
 
     size_t mmap_size = sysconf(_SC_PAGESIZE) * PERF_PAGES;
     /* printf("mmap_size = %zu\n", mmap_size); */
     struct perf_event_mmap_page *p = libc_mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, pfd[cpu_idx][type], 0);
     LOG_DEBUG("PEBS: cpu: %u, type: %llu, buffer size: %lu\n", cpu_idx, type, mmap_size);
-    pebs_stats.internal_mem_overhead += mmap_size;
 
-    assert(p != MAP_FAILED);
+    if (p == MAP_FAILED) {
+        perror("perf mmap");
+        close(pfd[cpu_idx][type]);
+        pfd[cpu_idx][type] = -1;
+        return NULL;
+    }
+    __atomic_fetch_add(&pebs_stats.internal_mem_overhead, mmap_size, __ATOMIC_RELAXED);
     fprintf(stderr, "Set up perf on core %llu\n", cpu);
 
 
     return p;
 }
 
+static void perf_teardown(uint32_t cpu_idx, int type) {
+    size_t mmap_size = sysconf(_SC_PAGESIZE) * PERF_PAGES;
+    if (perf_page[cpu_idx][type] != NULL) {
+        libc_munmap(perf_page[cpu_idx][type], mmap_size);
+        __atomic_fetch_sub(&pebs_stats.internal_mem_overhead, mmap_size, __ATOMIC_RELAXED);
+        perf_page[cpu_idx][type] = NULL;
+    }
+    if (pfd[cpu_idx][type] != -1) {
+        close(pfd[cpu_idx][type]);
+        pfd[cpu_idx][type] = -1;
+    }
+}
+
+static bool pebs_cpu_open(int slot) {
+    int cpu = atomic_load_explicit(&pebs_cpus[slot].cpu, memory_order_acquire);
+    for (int evt = 0; evt < PEBS_NRINGS; evt++) {
+        perf_page[slot][evt] = perf_setup(ring_config[evt].config, ring_config[evt].config1, slot, cpu, evt);
+        if (perf_page[slot][evt] == NULL) {
+            for (int i = 0; i <= evt; i++) {
+                perf_teardown(slot, i);
+            }
+            return false;
+        }
+        no_samples[slot][evt] = 0;
+    }
+    pebs_cpus[slot].active = true;
+    STAT_INC(pebs_stats.sampled_cpus);
+    return true;
+}
+
+static void pebs_cpu_close(int slot) {
+    if (pebs_cpus[slot].active) {
+        for (int evt = 0; evt < PEBS_NRINGS; evt++) {
+            perf_teardown(slot, evt);
+        }
+        pebs_cpus[slot].active = false;
+        __atomic_fetch_sub(&pebs_stats.sampled_cpus, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "Stopped perf on core %d\n", atomic_load(&pebs_cpus[slot].cpu));
+    }
+    atomic_store_explicit(&pebs_cpus[slot].want, false, memory_order_relaxed);
+    // Slot can be reused by the rescan from here on
+    atomic_store_explicit(&pebs_cpus[slot].cpu, -1, memory_order_release);
+}
+
+// Open or close this shard's events to match what the rescan asked for.
+// Returns true if the set of open events changed
+static bool reconcile_cpus(int shard) {
+    bool changed = false;
+    for (int slot = shard; slot < PEBS_NPROCS; slot += PEBS_NSCANNERS) {
+        bool want = atomic_load_explicit(&pebs_cpus[slot].want, memory_order_acquire);
+        if (want && !pebs_cpus[slot].active) {
+            if (!pebs_cpu_open(slot)) pebs_cpu_close(slot);
+            changed = true;
+        } else if (!want && pebs_cpus[slot].active) {
+            pebs_cpu_close(slot);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Parse a kernel cpu list such as "0-3,8,10-11"
+static bool parse_cpu_list_file(const char *path, cpu_set_t *set) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return false;
+
+    char buf[4096];
+    bool ok = fgets(buf, sizeof(buf), fp) != NULL;
+    fclose(fp);
+    if (!ok) return false;
+
+    CPU_ZERO(set);
+    char *s = buf;
+    while (*s != '\0' && *s != '\n') {
+        char *end;
+        long lo = strtol(s, &end, 10);
+        if (end == s) return false;
+        long hi = lo;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+        }
+        for (long c = lo; c <= hi && c < CPU_SETSIZE; c++) CPU_SET(c, set);
+        s = (*end == ',') ? end + 1 : end;
+    }
+    return true;
+}
+
+// Effective cpus of this process's cpuset cgroup (v2, then v1)
+static bool cgroup_cpuset(cpu_set_t *set) {
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL) return false;
+
+    char line[1024], path[1200];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char *ctrl = strchr(line, ':');
+        char *cg = ctrl ? strchr(ctrl + 1, ':') : NULL;
+        if (cg == NULL) continue;
+        *cg++ = '\0';
+        ctrl++;
+        if (strcmp(ctrl, "") == 0) {
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpuset.cpus.effective", cg);
+        } else if (strstr(ctrl, "cpuset") != NULL) {
+            snprintf(path, sizeof(path), "/sys/fs/cgroup/cpuset%s/cpuset.effective_cpus", cg);
+        } else {
+            continue;
+        }
+        found = parse_cpu_list_file(path, set);
+    }
+    fclose(fp);
+    return found;
+}
+
+static inline bool is_internal_tid(pid_t tid) {
+    for (int i = 0; i < NUM_INTERNAL_THREADS; i++) {
+        if (internal_tids[i] == tid) return true;
+    }
+    return false;
+}
+
+// Limits set to the process's cpuset and the online cpus
+static void limit_cpus(cpu_set_t *set) {
+    cpu_set_t tmp;
+    if (cgroup_cpuset(&tmp)) {
+        CPU_AND(set, set, &tmp);
+    }
+    if (parse_cpu_list_file("/sys/devices/system/cpu/online", &tmp)) {
+        CPU_AND(set, set, &tmp);
+    }
+}
+
+// cpus the application can run on: union of its threads' affinity masks
+// (or just the calling thread's), limited to its cpuset and the online cpus
+static void discover_cpus(cpu_set_t *set, bool all_tasks) {
+    cpu_set_t tmp;
+    CPU_ZERO(set);
+
+    if (all_tasks) {
+        DIR *dir = opendir("/proc/self/task");
+        struct dirent *ent;
+        while (dir != NULL && (ent = readdir(dir)) != NULL) {
+            pid_t tid = atoi(ent->d_name);
+            if (tid <= 0 || is_internal_tid(tid)) continue;
+            if (sched_getaffinity(tid, sizeof(tmp), &tmp) == 0) {
+                CPU_OR(set, set, &tmp);
+            }
+        }
+        if (dir != NULL) closedir(dir);
+    } else if (sched_getaffinity(0, sizeof(tmp), &tmp) == 0) {
+        CPU_OR(set, set, &tmp);
+    }
+
+    limit_cpus(set);
+}
+
+// Diff the discovered cpus against the slots and hand changes to the owning shards
+static void rescan_cpus(bool all_tasks) {
+    cpu_set_t want_set, have_set;
+#if PEBS_TASK_MODE == 1
+    // inherit only reaches threads created after an event is opened, so a
+    // cpu added once the application runs would never see its existing
+    // threads. Every cpu of the cpuset is opened from the start instead of
+    // following affinity, task events cost nothing where the process doesn't
+    // run. Only a cpu brought online later still misses the existing threads
+    (void)all_tasks;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &want_set);
+    limit_cpus(&want_set);
+#else
+    discover_cpus(&want_set, all_tasks);
+#endif
+    CPU_ZERO(&have_set);
+
+    for (int slot = 0; slot < PEBS_NPROCS; slot++) {
+        int cpu = atomic_load_explicit(&pebs_cpus[slot].cpu, memory_order_acquire);
+        if (cpu < 0) continue;
+        // Still being torn down if want is already false, retry on the next rescan
+        CPU_SET(cpu, &have_set);
+        if (!CPU_ISSET(cpu, &want_set) && atomic_load(&pebs_cpus[slot].want)) {
+            LOG_DEBUG("PEBS: removing cpu %d\n", cpu);
+            STAT_INC(pebs_stats.cpu_removes);
+            atomic_store_explicit(&pebs_cpus[slot].want, false, memory_order_release);
+        }
+    }
+
+    int slot = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &want_set) || CPU_ISSET(cpu, &have_set)) continue;
+        while (slot < PEBS_NPROCS && atomic_load_explicit(&pebs_cpus[slot].cpu, memory_order_acquire) >= 0) slot++;
+        if (slot == PEBS_NPROCS) {
+            LOG_DEBUG("PEBS: more than PEBS_NPROCS cpus, not sampling cpu %d\n", cpu);
+            break;
+        }
+        LOG_DEBUG("PEBS: adding cpu %d in slot %d\n", cpu, slot);
+        STAT_INC(pebs_stats.cpu_adds);
+        atomic_store_explicit(&pebs_cpus[slot].cpu, cpu, memory_order_relaxed);
+        atomic_store_explicit(&pebs_cpus[slot].want, true, memory_order_release);
+    }
+}
+
+// Pins a shard's thread. A cpu past what the process may run on wraps
+// around onto the discovered cpus, if even that fails the thread runs unpinned
+static void pin_shard_thread(pthread_t thread, int cpu) {
+    cpu_set_t allowed, cpuset;
+    discover_cpus(&allowed, false);
+    int count = CPU_COUNT(&allowed);
+    if (count != 0 && !CPU_ISSET(cpu, &allowed)) {
+        int n = cpu % count;
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && n-- == 0) break;
+        }
+    }
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    int s = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset);
+    if (s != 0) {
+        fprintf(stderr, "PEBS: could not pin to cpu %d, running unpinned\n", cpu);
+    }
+}
+
 void* pebs_stats_thread() {
     internal_call = true;
+    internal_tids[PEBS_STATS_THREAD] = syscall(SYS_gettid);
 
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
@@ -115,39 +426,113 @@ void* pebs_stats_thread() {
 
     while (!killed(PEBS_STATS_THREAD)) {
         sleep(1);
+        // Counters reset every interval are taken with an exchange, so
+        // nothing the other threads add between the log and the reset is lost
+        struct pebs_stats stats = pebs_stats;
+        stats.dram_accesses = STAT_TAKE(pebs_stats.dram_accesses);
+        stats.rem_accesses = STAT_TAKE(pebs_stats.rem_accesses);
+        stats.dram_stall_cycles = STAT_TAKE(pebs_stats.dram_stall_cycles);
+        stats.cxl_accesses = STAT_TAKE(pebs_stats.cxl_accesses);
+        stats.cache_hits = STAT_TAKE(pebs_stats.cache_hits);
+        stats.dram_stores = STAT_TAKE(pebs_stats.dram_stores);
+        stats.rem_stores = STAT_TAKE(pebs_stats.rem_stores);
+        stats.write_skips = STAT_TAKE(pebs_stats.write_skips);
+        stats.rem_stall_cycles = STAT_TAKE(pebs_stats.rem_stall_cycles);
+        stats.promotions = STAT_TAKE(pebs_stats.promotions);
+        stats.demotions = STAT_TAKE(pebs_stats.demotions);
+        stats.throttles = STAT_TAKE(pebs_stats.throttles);
+        stats.unthrottles = STAT_TAKE(pebs_stats.unthrottles);
+        stats.pebs_resets = STAT_TAKE(pebs_stats.pebs_resets);
+        stats.scan_sleeps = STAT_TAKE(pebs_stats.scan_sleeps);
+        stats.mig_sleeps = STAT_TAKE(pebs_stats.mig_sleeps);
+        stats.max_wake_latency = STAT_TAKE(pebs_stats.max_wake_latency);
+        stats.page_scans = STAT_TAKE(pebs_stats.page_scans);
+        stats.scanned_accessed = STAT_TAKE(pebs_stats.scanned_accessed);
+        stats.scanned_idle = STAT_TAKE(pebs_stats.scanned_idle);
+        stats.hint_armed = STAT_TAKE(pebs_stats.hint_armed);
+        stats.hint_faults = STAT_TAKE(pebs_stats.hint_faults);
+        stats.hint_timeouts = STAT_TAKE(pebs_stats.hint_timeouts);
         LOG_STATS("internal_mem_overhead: [%lu]\tmem_allocated: [%lu]\tthrottles: [%lu]\tunthrottles: [%lu]\tunknown_samples: [%lu]\n", 
-                pebs_stats.internal_mem_overhead, pebs_stats.mem_allocated, pebs_stats.throttles, pebs_stats.unthrottles, pebs_stats.unknown_samples)
+                stats.internal_mem_overhead, stats.mem_allocated, stats.throttles, stats.unthrottles, stats.unknown_samples)
         LOG_STATS("\twrapped_records: [%lu]\twrapped_headers: [%lu]\n", 
-                pebs_stats.wrapped_records, pebs_stats.wrapped_headers);
+                stats.wrapped_records, stats.wrapped_headers);
+        LOG_STATS("\tprocessed_samples: [%lu]\tshed_samples: [%lu]\tkernel_lost: [%lu]\tforeign_samples: [%lu]\tunresolved_samples: [%lu]\n",
+                stats.processed_samples, stats.shed_samples, stats.kernel_lost, stats.foreign_samples,
+                stats.unresolved_samples);
 
 #if DRAM_BUFFER != 0
         LOG_STATS("\tdram_free: [%ld]\tdram_used: [%ld]\t dram_size: [%ld]\trem_used: [%ld]\n", dram_free, dram_used, dram_size, rem_used);
 #endif
 #if DRAM_SIZE != 0
-        LOG_STATS("\tdram_used: [%ld]\t dram_size: [%ld]\tnon_tracked_mem: [%lu]\n", dram_used, dram_size, pebs_stats.non_tracked_mem);
+        LOG_STATS("\tdram_used: [%ld]\t dram_size: [%ld]\tnon_tracked_mem: [%lu]\n", dram_used, dram_size, stats.non_tracked_mem);
 #endif
-        double percent_dram = 100.0 * pebs_stats.dram_accesses / (pebs_stats.dram_accesses + pebs_stats.rem_accesses);
+        LOG_STATS("\tlazy_ranges: [%lu]\tlazy_pages: [%lu]\n", stats.lazy_ranges, stats.lazy_pages);
+        LOG_STATS("\tmremaps: [%lu]\tmprotects: [%lu]\tmadvise_drops: [%lu]\theap_grows: [%lu]\n",
+                  stats.mremaps, stats.mprotects, stats.madvise_drops, stats.heap_grows);
+        double percent_dram = 100.0 * stats.dram_accesses / (stats.dram_accesses + stats.rem_accesses);
         LOG_STATS("\tdram_accesses: [%ld]\trem_accesses: [%ld]\t percent_dram: [%.2f]\n", 
-            pebs_stats.dram_accesses, pebs_stats.rem_accesses, percent_dram);
+            stats.dram_accesses, stats.rem_accesses, percent_dram);
+#if PEBS_DATA_SRC == 1
+        LOG_STATS("\tcxl_accesses: [%lu]\tcache_hits: [%lu]\n", stats.cxl_accesses, stats.cache_hits);
+#endif
+#if PEBS_STORES == 1
+        LOG_STATS("\tdram_stores: [%lu]\trem_stores: [%lu]\twrite_skips: [%lu]\n",
+            stats.dram_stores, stats.rem_stores, stats.write_skips);
+#endif
+#if PEBS_WEIGHTED_HOTNESS == 1
+        LOG_STATS("\tdram_stall_cycles: [%lu]\trem_stall_cycles: [%lu]\tavg_dram_lat: [%.1f]\tavg_rem_lat: [%.1f]\n",
+            stats.dram_stall_cycles, stats.rem_stall_cycles,
+            (double)stats.dram_stall_cycles / (stats.dram_accesses + 1),
+            (double)stats.rem_stall_cycles / (stats.rem_accesses + 1));
+#endif
         
-        uint64_t migrations = pebs_stats.promotions + pebs_stats.demotions;
+        uint64_t migrations = stats.promotions + stats.demotions;
         LOG_STATS("\tpromotions: [%lu]\tdemotions: [%lu]\tmigrations: [%lu]\tpebs_resets: [%lu]\tmig_move_time: [%.2f]\tmig_queue_time: [%.2f]\n", 
-                pebs_stats.promotions, pebs_stats.demotions, migrations, pebs_stats.pebs_resets, mig_move_time, mig_queue_time);
+                stats.promotions, stats.demotions, migrations, stats.pebs_resets, mig_move_time, mig_queue_time);
 
         LOG_STATS("\tthreshold: [%.2f]\tavg_dist: [%.2f]\tdiff: [%.2f]\n", bot_dist, avg_dist, avg_dist - bot_dist);
 
         LOG_STATS("\tcold_pages: [%lu]\thot_pages: [%lu]\n", cold_list.numentries, hot_list.numentries);
+        LOG_STATS("\tscan_sleeps: [%lu]\tmig_sleeps: [%lu]\tmax_wake_latency: [%lu]\n",
+                stats.scan_sleeps, stats.mig_sleeps, stats.max_wake_latency);
+        LOG_STATS("\tsampled_cpus: [%lu]\tcpu_adds: [%lu]\tcpu_removes: [%lu]\n",
+                stats.sampled_cpus, stats.cpu_adds, stats.cpu_removes);
+#if PEBS_ADAPTIVE_PERIOD == 1
+        LOG_STATS("\tsample_period: [%lu]\tsample_rate: [%lu]\n", stats.sample_period, stats.sample_rate);
+#endif
+#if SAMPLE_SOURCE == SOURCE_IDLE || SAMPLE_SOURCE == SOURCE_DAMON
+        LOG_STATS("\tpage_scans: [%lu]\tscanned_accessed: [%lu]\tscanned_idle: [%lu]\n",
+                stats.page_scans, stats.scanned_accessed, stats.scanned_idle);
+#endif
+#if TMEM_FINE == 1
+        LOG_STATS("\tfine_promotions: [%lu]\tfine_demotions: [%lu]\n", stats.fine_promotions, stats.fine_demotions);
+#endif
+#if TMEM_MALLOC == 1
+        LOG_STATS("\tmalloc_extent_allocs: [%lu]\tmalloc_extent_frees: [%lu]\n", stats.malloc_extent_allocs, stats.malloc_extent_frees);
+#endif
+#if SAMPLE_SOURCE == SOURCE_HINT
+        LOG_STATS("\thint_armed: [%lu]\thint_faults: [%lu]\thint_timeouts: [%lu]\n",
+                stats.hint_armed, stats.hint_faults, stats.hint_timeouts);
+#endif
 
-
-
-        pebs_stats.dram_accesses = 0;
-        pebs_stats.rem_accesses = 0;
-        pebs_stats.promotions = 0;
-        pebs_stats.demotions = 0;
-        pebs_stats.throttles = 0;
-        pebs_stats.unthrottles = 0;
-        pebs_stats.pebs_resets = 0;
-        
+        for (int s = 0; s < PEBS_NSCANNERS; s++) {
+            struct pebs_shard_stats shard = pebs_shard_stats[s];
+            shard.samples = STAT_TAKE(pebs_shard_stats[s].samples);
+            shard.backlog = STAT_TAKE(pebs_shard_stats[s].backlog);
+            shard.drops = STAT_TAKE(pebs_shard_stats[s].drops);
+#if PEBS_PIPELINE == 1
+            shard.ring_full = STAT_TAKE(pebs_shard_stats[s].ring_full);
+            shard.ring_drops = STAT_TAKE(pebs_shard_stats[s].ring_drops);
+            shard.ring_hwm = STAT_TAKE(pebs_shard_stats[s].ring_hwm);
+#endif
+            LOG_STATS("\tshard: [%d]\tsamples: [%lu]\tbacklog: [%lu]\tdrops: [%lu]\n", s,
+                shard.samples, shard.backlog, shard.drops);
+#if PEBS_PIPELINE == 1
+            LOG_STATS("\tshard: [%d]\tring_full: [%lu]\tring_drops: [%lu]\tring_hwm: [%lu]\tpolicy_cycles: [%lu]\n", s,
+                shard.ring_full, shard.ring_drops, shard.ring_hwm,
+                shard.policy_cycles);
+#endif
+        }
 
 #if DRAM_BUFFER != 0
         // hacky way to update dram_used every second in case there's drift over time
@@ -168,194 +553,385 @@ static void start_pebs_stats_thread() {
     assert(s == 0);
 }
 
-// Could be munmapped at any time
+// Remote pages, and with TMEM_FINE DRAM pages with hot base pages left in
+// remote memory, are what promotions are for
+#if TMEM_FINE == 1
+#define PAGE_WANTS_DRAM(page, state) (((state) & PAGE_REM) || fine_pending(page))
+#else
+#define PAGE_WANTS_DRAM(page, state) ((state) & PAGE_REM)
+#endif
+
+// A hot page in remote memory goes on the hot list, with LRU_ALGO a page in
+// DRAM moves to the back of the cold list. Nothing moves while the migrate
+// thread has the page
+static inline bool hot_request_moves(struct tmem_page *page, uint32_t state) {
+    if (state & (PAGE_FREE | PAGE_MIGRATING)) return false;
+    if (PAGE_WANTS_DRAM(page, state)) return PAGE_LIST(state) != LIST_HOT;
+#if LRU_ALGO == 1
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Could be munmapped at any time, PAGE_FREE is checked on every transition
 void make_hot_request(struct tmem_page* page) {
     if (page == NULL) return;
-    // page could be munmapped here (but pages are never actually
-    // unmapped so just check if it's in free state once locked)
-    if (pthread_mutex_trylock(&page->page_lock) != 0) { // Abort if lock taken to speed up pebs thread
+    uint32_t state = page_state(page);
+    if (!hot_request_moves(page, state)) {
+        // Common case, already queued or in DRAM, one load and no store
+        if (!(state & (PAGE_HOT | PAGE_FREE))) page_state_set(page, PAGE_HOT, 0);
         return;
     }
-    // pthread_mutex_lock(&page->page_lock);
-    // check if unmapped
-    if (page->free) {
-        // printf("Page was free\n");
-        pthread_mutex_unlock(&page->page_lock);
-        return;
-    }
-    page->hot = true;
-    
-    // add to hot list if:
-    // page is not already in hot list and in remote mem
-    if (page->list != &hot_list && page->in_dram == IN_REM) {
-        // page should not be hot
-        // not be cold since all cold pages are in dram
-        // not be free 
-        // either was in remote mem or just got dequeued
-        // from cold list in migrate thread
-        // page->list == &cold_list and in Remote
-#if LRU_ALGO == 0
-        if (page->list != NULL) {
-            assert(page->list == &cold_list);
-            page_list_remove_page(&cold_list, page);
-        }
-#endif
-        assert(page->list == NULL);
-        enqueue_fifo(&hot_list, page);
-        page->mig_start = rdtscp();
+    if (!page_busy_begin(page, 0, &state)) return;
 
+    if (hot_request_moves(page, state)) {
+        // Off its list if the migrate thread dequeued it since, remote pages
+        // are only on the cold list between a demotion and the next request
+        if (page->cold->list != NULL) {
+            page_list_remove_page(page->cold->list, page);
+        }
+        assert(page->cold->list == NULL);
+        if (PAGE_WANTS_DRAM(page, state)) {
+            enqueue_fifo(&hot_list, page);
+            page->cold->mig_start = rdtscp();
+            state = PAGE_SET_LIST(state, LIST_HOT);
+        } else {
+            // LRU, most recently used DRAM page goes to the back of the cold list
+            enqueue_fifo(&cold_list, page);
+            state = PAGE_SET_LIST(state, LIST_COLD);
+        }
     }
+    page_busy_end(page, state | PAGE_HOT);
+}
+
+// A DRAM page goes on the cold list, with LRU_ALGO to its back every time
+static inline bool cold_request_moves(uint32_t state) {
+    if (state & (PAGE_FREE | PAGE_MIGRATING | PAGE_REM)) return false;
 #if LRU_ALGO == 1
-    // If already in dram update LRU cold list
-    else if (page->in_dram == IN_DRAM) {
-        assert(page->list == &cold_list);
-        page_list_remove_page(&cold_list, page);
-        enqueue_fifo(&cold_list, page);
-    }
+    return true;
+#else
+    return PAGE_LIST(state) != LIST_COLD;
 #endif
-    // printf("page is either already in hot list or is in remote memory\n");
-    
-    pthread_mutex_unlock(&page->page_lock);
-
 }
 
 void make_cold_request(struct tmem_page* page) {
     if (page == NULL) return;
-    // page could be munmapped here (but pages are never actually
-    // unmapped so just check if it's in free state once locked)
-    if (pthread_mutex_trylock(&page->page_lock) != 0) { // Abort if lock taken to speed up pebs thread
-        LOG_DEBUG("Failed lock: 0x%lx\n", page->va);
+    uint32_t state = page_state(page);
+    if (!cold_request_moves(state)) {
+        if ((state & PAGE_HOT) && !(state & PAGE_FREE)) page_state_set(page, 0, PAGE_HOT);
         return;
     }
-    // check if unmapped
-    if (page->free) {
-        pthread_mutex_unlock(&page->page_lock);
-        return;
-    }
-    page->hot = false;
-#if LRU_ALGO == 0
-    // move to cold list if:
-    // page is not already in cold list and
-    // page is in dram
-    if (page->list != &cold_list && page->in_dram == IN_DRAM) {
-        // remove from hot list
-        if (page->list != NULL) {
-            assert(page->list == &hot_list);
-            page_list_remove_page(&hot_list, page);
-        }
-        assert(page->list == NULL);
+    if (!page_busy_begin(page, 0, &state)) return;
+
+    if (cold_request_moves(state)) {
+        if (page->cold->list != NULL) {
+            page_list_remove_page(page->cold->list, page);
+        }
+        assert(page->cold->list == NULL);
         enqueue_fifo(&cold_list, page);
+        state = PAGE_SET_LIST(state, LIST_COLD);
     }
-#else
-    // Even if page is already in cold list
-    // move to back of cold list for LRU
-    if (page->in_dram == IN_DRAM) {
-        // assert(page->list != NULL);
-        assert(page->list != &free_list);
-        if (page->list != NULL) {   // page could be dequeued from migrate thread
-            page_list_remove_page(page->list, page);
-        }
+    page_busy_end(page, state & ~PAGE_HOT);
+}
+static uint64_t samples_since_cool = 0;
 
-        assert(page->list == NULL);
-        enqueue_fifo(&cold_list, page);
+static inline uint64_t scale_accesses(uint64_t acc, int shift) {
+    if (shift >= 64) return 0;
+    if (shift >= 0) return acc >> shift;
+    if (-shift >= 64 || acc > (UINT64_MAX >> -shift)) return UINT64_MAX;
+    return acc << -shift;
+}
+
+// Cool and count one access. Scanner shards race on the same page, so the
+// rescale is claimed by whichever shard moves local_clock forward.
+// Each halving of the period doubles what a past sample is worth in current
+// samples and vice versa, so counts stay comparable across period changes
+static inline void scale_counter32(uint32_t *counter, int shift) {
+    uint32_t val = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    uint64_t scaled;
+    do {
+        scaled = scale_accesses(val, shift);
+        if (scaled > UINT32_MAX) scaled = UINT32_MAX;
+    } while (!__atomic_compare_exchange_n(counter, &val, (uint32_t)scaled, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void page_touch(struct tmem_page *page, uint64_t count, bool write) {
+    uint64_t clock = atomic_load_explicit(&global_clock, memory_order_acquire);
+    int pshift = atomic_load_explicit(&period_shift, memory_order_acquire);
+    uint64_t stamp = PAGE_STAMP(clock, pshift);
+    uint64_t local = __atomic_load_n(&page->local_clock, __ATOMIC_ACQUIRE);
+
+    if (local != stamp && STAMP_CLOCK(local) <= clock
+        && __atomic_compare_exchange_n(&page->local_clock, &local, stamp, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        int shift = (int)(clock - STAMP_CLOCK(local)) + (pshift - STAMP_SHIFT(local));
+        uint64_t acc = __atomic_load_n(&page->accesses, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&page->accesses, &acc, scale_accesses(acc, shift),
+                                            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        scale_counter32(&page->reads, shift);
+        scale_counter32(&page->writes, shift);
+#if TMEM_FINE == 1
+        fine_cool(page, shift);
+#endif
     }
+    __atomic_fetch_add(&page->accesses, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(write ? &page->writes : &page->reads, 1, __ATOMIC_RELAXED);
+}
+
+#if CLUSTER_ALGO == 1
+// Keep the ip of the most recent access, cyc_accessed only moves forward.
+// Only the cluster algorithm reads them
+static inline void page_update_last_access(struct tmem_page *page, uint64_t time, uint64_t ip) {
+    uint64_t cyc = __atomic_load_n(&page->cold->cyc_accessed, __ATOMIC_RELAXED);
+    while (time > cyc) {
+        if (__atomic_compare_exchange_n(&page->cold->cyc_accessed, &cyc, time, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            page->cold->ip = ip;
+            break;
+        }
+    }
+}
 #endif
-    pthread_mutex_unlock(&page->page_lock);
+
+static inline void maybe_cool(uint64_t cur_cyc) {
+    uint64_t last = atomic_load_explicit(&last_cyc_cool, memory_order_relaxed);
+    if (cur_cyc - last > CYC_COOL_THRESHOLD
+        && atomic_compare_exchange_strong(&last_cyc_cool, &last, cur_cyc)) {
+        atomic_fetch_add_explicit(&global_clock, 1, memory_order_release);
+    }
 }
-static uint64_t samples_since_cool = 0;
 
-void process_perf_buffer(int cpu_idx, int evt) {
-    struct perf_event_mmap_page *p = perf_page[cpu_idx][evt];
-    uint64_t num_loops = 0;
+// Copy len bytes at ring position pos, following the wrap at the end of the ring
+static inline void perf_ring_copy(const char *data, uint64_t data_size, uint64_t pos, void *dst, size_t len) {
+    uint64_t off = pos & (data_size - 1);
+    if (off + len <= data_size) {
+        memcpy(dst, data + off, len);
+    } else {
+        uint64_t first = data_size - off;
+        memcpy(dst, data + off, first);
+        memcpy((char *)dst + first, data, len - first);
+    }
+}
 
-    while (p->data_head != p->data_tail && num_loops++ != 128) {
-        
-        struct perf_sample rec = {.addr = 0};
-        char *data = (char*)p + p->data_offset;
-        uint64_t avail = p->data_head - p->data_tail;
+#if PEBS_DATA_SRC == 1
+// Tier that served a load: DRAMREAD for local memory, REMREAD for anything
+// off node (remote DRAM, CXL, PMEM), -1 for cache hits and unknown sources
+static inline int classify_data_src(__u64 val) {
+    union perf_mem_data_src src = { .val = val };
+
+    if (src.mem_lvl_num == PERF_MEM_LVLNUM_CXL) {
+        STAT_INC(pebs_stats.cxl_accesses);
+        return REMREAD;
+    }
+    if (src.mem_lvl_num == PERF_MEM_LVLNUM_RAM || src.mem_lvl_num == PERF_MEM_LVLNUM_PMEM) {
+        return src.mem_remote ? REMREAD : DRAMREAD;
+    }
+    // Kernels that only fill in the legacy mem_lvl bits
+    if (src.mem_lvl & PERF_MEM_LVL_LOC_RAM) return DRAMREAD;
+    if (src.mem_lvl & (PERF_MEM_LVL_REM_RAM1 | PERF_MEM_LVL_REM_RAM2)) return REMREAD;
 
-        // LOG_DEBUG("Backlog: %lu\n", avail / (sizeof(struct perf_sample) + sizeof(struct perf_event_header)));
+    STAT_INC(pebs_stats.cache_hits);
+    return -1;
+}
+#endif
 
-        assert(((p->data_size - 1) & p->data_size) == 0);
-        assert(p->data_size != 0);
+// Only remote loads and stores drive promotions, so local loads are shed first
+static inline bool sample_low_priority(uint8_t evt) {
+    return evt == DRAMREAD;
+}
 
-        // header
-        uint64_t wrapped_tail = p->data_tail & (p->data_size - 1);
-        struct perf_event_header *hdr = (struct perf_event_header *)(data + wrapped_tail);
+// Perf stamps samples with its own clock, the other sources and the trace
+// use the TSC. Converted back the way perf_event.h describes, kernels that
+// don't export the conversion get the time the record is decoded
+static inline uint64_t perf_time_to_cyc(struct perf_event_mmap_page *p, uint64_t time) {
+    if (!p->cap_user_time_zero || p->time_mult == 0) return rdtscp();
+    uint64_t t = time - p->time_zero;
+    uint64_t quot = t / p->time_mult, rem = t % p->time_mult;
+    return (quot << p->time_shift) + (rem << p->time_shift) / p->time_mult;
+}
 
-        assert(hdr->size != 0);
-        assert(avail >= hdr->size);
+// Decode records in [*tail, head) into batch until batch holds max samples.
+// Records are read in place unless they straddle the ring end, in which case
+// they go through a bounce buffer. *tail is left at the first undecoded record.
+// Samples are shed instead of batched once *budget runs out, or if they are
+// low priority while overloaded
+static uint32_t decode_perf_buffer(struct perf_event_mmap_page *p, int cpu_idx, int evt,
+                                   struct pebs_sample *batch, uint32_t max, uint64_t *tail, uint64_t head,
+                                   bool overloaded, uint32_t *budget, uint64_t *shed, uint64_t *foreign) {
+    const char *data = (const char *)p + p->data_offset;
+    uint64_t data_size = p->data_size;
+    uint64_t pos = *tail;
+    uint32_t n = 0;
+    char bounce[PERF_BOUNCE_SIZE];
+
+    assert(((data_size - 1) & data_size) == 0);
+    assert(data_size != 0);
+
+    while (pos != head && n < max) {
+        struct perf_event_header hdr;
+        perf_ring_copy(data, data_size, pos, &hdr, sizeof(hdr));
+
+        assert(hdr.size != 0);
+        assert(head - pos >= hdr.size);
+
+        uint64_t off = pos & (data_size - 1);
+        const char *rec = data + off;
+        if (off + hdr.size > data_size) {
+            STAT_INC(pebs_stats.wrapped_records);
+            if (hdr.size > sizeof(bounce)) {
+                STAT_INC(pebs_stats.unknown_samples);
+                pos += hdr.size;
+                continue;
+            }
+            perf_ring_copy(data, data_size, pos, bounce, hdr.size);
+            rec = bounce;
+        }
 
-        if (wrapped_tail + hdr->size <= p->data_size) {
-            switch (hdr->type) {
-                case PERF_RECORD_SAMPLE:
-                    if (hdr->size - sizeof(struct perf_event_header) == sizeof(struct perf_sample)) {
-                        memcpy(&rec, data + wrapped_tail + sizeof(struct perf_event_header), sizeof(struct perf_sample));
-                        // rec = (struct perf_sample *)(data + wrapped_tail + sizeof(struct perf_event_header));
-                        // printf("addr: 0x%llx, ip: 0x%llx, time: %llu\n", rec->addr, rec->ip, rec->time);
+        switch (hdr.type) {
+            case PERF_RECORD_SAMPLE:
+                if (hdr.size - sizeof(struct perf_event_header) == sizeof(struct perf_sample)) {
+                    const struct perf_sample *s = (const struct perf_sample *)(rec + sizeof(struct perf_event_header));
+                    if (s->addr == 0) break;
+                    if (s->pid != tracked_pid || is_internal_tid(s->tid)) {
+                        (*foreign)++;
+                        break;
                     }
-                    break;
-                case PERF_RECORD_THROTTLE:
-                    pebs_stats.throttles++;
-                    break;
-                case PERF_RECORD_UNTHROTTLE:
-                    pebs_stats.unthrottles++;
-                    break;
-                default:
-                    pebs_stats.unknown_samples++;
-                    break;
+                    int tier = ring_config[evt].evt;
+#if PEBS_DATA_SRC == 1
+                    if (tier < 0) tier = classify_data_src(s->data_src);
+                    if (tier < 0) break;
+#endif
+                    if (*budget == 0 || (overloaded && sample_low_priority(tier))) {
+                        (*shed)++;
+                    } else {
+                        (*budget)--;
+                        batch[n].addr = s->addr;
+                        batch[n].ip = s->ip;
+                        batch[n].time = perf_time_to_cyc(p, s->time);
+                        batch[n].tid = s->tid;
+#if PEBS_WEIGHTED_HOTNESS == 1
+                        batch[n].weight = (uint32_t)s->weight;
+#else
+                        batch[n].weight = 0;
+#endif
+                        batch[n].cpu_idx = cpu_idx;
+                        batch[n].evt = tier;
+                        n++;
+                    }
+                }
+                break;
+            case PERF_RECORD_LOST: {
+                // struct { header; u64 id; u64 lost; }
+                uint64_t lost;
+                memcpy(&lost, rec + sizeof(struct perf_event_header) + sizeof(uint64_t), sizeof(lost));
+                __atomic_fetch_add(&pebs_stats.kernel_lost, lost, __ATOMIC_RELAXED);
+                break;
             }
-        } else {
-            pebs_stats.wrapped_records++;
+            case PERF_RECORD_THROTTLE:
+                STAT_INC(pebs_stats.throttles);
+                atomic_store_explicit(&throttle_seen, true, memory_order_relaxed);
+                break;
+            case PERF_RECORD_UNTHROTTLE:
+                STAT_INC(pebs_stats.unthrottles);
+                break;
+            default:
+                STAT_INC(pebs_stats.unknown_samples);
+                break;
         }
-        p->data_tail += hdr->size;
- 
-        /* Have PEBS Sample, Now check with tmem */
-        // continue;
-        if (rec.addr == 0) continue;
+        pos += hdr.size;
+    }
+    *tail = pos;
+    return n;
+}
 
-        uint64_t addr_aligned = rec.addr & PAGE_MASK;
-        struct tmem_page *page = find_page_no_lock(addr_aligned);
+// Policy stage for a decoded batch. Returns the number of samples that hit a tracked page
+static uint32_t process_samples(int shard, struct pebs_sample *batch, uint32_t n) {
+    struct pebs_shard_stats *sstats = &pebs_shard_stats[shard];
+    struct tmem_page *pages[PEBS_BATCH_SIZE];
+    uint32_t found = 0;
+
+    // Pages looked up here can't be recycled until the batch is done
+    epoch_enter();
+
+    // Resolve the whole batch first and prefetch the pages so the policy
+    // loop below doesn't stall on a metadata miss for every sample
+    for (uint32_t i = 0; i < n; i++) {
+        struct tmem_page *page = find_or_create_page(batch[i].addr);
+        if (page != NULL)
+            __builtin_prefetch(page, 1, 3);
+        pages[i] = page;
+    }
 
-        // Try 4KB aligned page if not 2MB aligned page
-        if (page == NULL)
-            page = find_page_no_lock(rec.addr & BASE_PAGE_MASK);
+#if HEM_ALGO == 1
+    uint64_t cur_cyc = rdtscp();
+#endif
+#if RECORD == 1
+    struct pebs_rec trace_recs[PEBS_BATCH_SIZE];
+    uint32_t num_trace_recs = 0;
+#endif
+
+    for (uint32_t i = 0; i < n; i++) {
+        struct tmem_page *page = pages[i];
         if (page == NULL) continue;
+        found++;
+
+        struct pebs_sample *rec = &batch[i];
 #if RECORD == 1
-        struct pebs_rec p_rec = {
-            .va = addr_aligned,
-            .ip = rec.ip,
-            .cyc = rdtscp(),
-            .cpu = cpu_idx,
-            .evt = evt
+        trace_recs[num_trace_recs++] = (struct pebs_rec) {
+            .va = rec->addr & PAGE_MASK,
+            .ip = rec->ip,
+            .cyc = rec->time,
+            .cpu = rec->cpu_idx,
+            .evt = rec->evt
         };
-        fwrite(&p_rec, sizeof(struct pebs_rec), 1, tmem_trace_fp);
 #endif
 
         // if (page->migrated) {
         //     LOG_DEBUG("PEBS: accessed migrated page: 0x%lx\n", page->va);
         // }
 
-        // cool off
-        page->accesses >>= (global_clock - page->local_clock);
-        page->local_clock = global_clock;
-
-        if (evt == DRAMREAD) pebs_stats.dram_accesses++;
-        else pebs_stats.rem_accesses++;
-        page->accesses++;
-
-        uint64_t cur_cyc = rdtscp();
-        if (rec.time > page->cyc_accessed) {
-            page->cyc_accessed = rec.time;
-            page->ip = rec.ip;
+        sstats->samples++;
+        // Stores don't say which tier they hit, go by where the page is
+        bool write = rec->evt == STOREWRITE;
+        bool local = write ? page_in_dram(page) : rec->evt == DRAMREAD;
+        uint64_t count = rec->count != 0 ? rec->count : 1;
+#if PEBS_WEIGHTED_HOTNESS == 1
+        // Hotness is the stall time the page cost, not how often it was hit
+        uint64_t weight = rec->weight;
+        if (weight == 0) weight = local ? DRAM_LATENCY : REM_LATENCY;
+        weight *= count;
+        if (local) __atomic_fetch_add(&pebs_stats.dram_stall_cycles, weight, __ATOMIC_RELAXED);
+        else __atomic_fetch_add(&pebs_stats.rem_stall_cycles, weight, __ATOMIC_RELAXED);
+#else
+        uint64_t weight = count;
+#endif
+        if (write) {
+            weight *= WRITE_WEIGHT;
+            if (local) STAT_INC(pebs_stats.dram_stores);
+            else STAT_INC(pebs_stats.rem_stores);
+        } else if (local) {
+            STAT_INC(pebs_stats.dram_accesses);
+        } else {
+            STAT_INC(pebs_stats.rem_accesses);
         }
+        page_touch(page, weight, write);
+#if TMEM_FINE == 1
+        fine_touch(page, rec->addr, count);
+#endif
+
+#if CLUSTER_ALGO == 1
+        page_update_last_access(page, rec->time, rec->ip);
+#endif
 
         // LRU cold list
         // if sample is cold move to end of cold queue
         // Everything in DRAM is cold
 
 #if HEM_ALGO == 1
+#if PEBS_WEIGHTED_HOTNESS == 1
+        if (page->accesses >= HOT_WEIGHT_THRESHOLD) {
+#else
         if (page->accesses >= HOT_THRESHOLD) {
+#endif
             // LOG_DEBUG("PEBS: Made hot: 0x%lx\n", page->va);
 #if RECORD == 1
             struct pebs_rec p_rec = {
@@ -382,11 +958,7 @@ void process_perf_buffer(int cpu_idx, int evt) {
         // }
 
         // Time based cooling
-        if (cur_cyc - last_cyc_cool > CYC_COOL_THRESHOLD) {
-            // __atomic_fetch_add(&global_clock, 1, __ATOMIC_RELEASE);
-            global_clock++;
-            last_cyc_cool = cur_cyc;
-        }
+        maybe_cool(cur_cyc);
 
 #endif 
 
@@ -425,73 +997,449 @@ void process_perf_buffer(int cpu_idx, int evt) {
         make_cold_request(page);
 #endif
 #endif
+    }
 
-        no_samples[cpu_idx][evt] = cur_cyc;
+#if RECORD == 1
+    if (num_trace_recs != 0)
+        fwrite(trace_recs, sizeof(struct pebs_rec), num_trace_recs, tmem_trace_fp);
+#endif
+    epoch_exit();
+    if (found != n)
+        __atomic_fetch_add(&pebs_stats.unresolved_samples, n - found, __ATOMIC_RELAXED);
+    return found;
+}
 
+#if PEBS_ADAPTIVE_PERIOD == 1
+// Run by shard 0. Moves the period one power of two per interval: up when the
+// kernel throttled or lost samples, samples were shed, or the rate/CPU budget
+// is exceeded; down when well under both targets
+static void period_controller() {
+    static struct timespec last_time;
+    static uint64_t last_cyc, last_samples, last_lost, last_shed, last_busy;
+
+    uint64_t cur_cyc = rdtscp();
+    if (last_cyc == 0) {
+        last_time = get_time();
+        last_cyc = cur_cyc;
+        return;
+    }
+    if (cur_cyc - last_cyc < PEBS_CTRL_INTERVAL) return;
+
+    struct timespec now = get_time();
+    double secs = elapsed_time(last_time, now);
+    uint64_t processed = __atomic_load_n(&pebs_stats.processed_samples, __ATOMIC_RELAXED);
+    uint64_t shed = __atomic_load_n(&pebs_stats.shed_samples, __ATOMIC_RELAXED);
+    uint64_t lost = __atomic_load_n(&pebs_stats.kernel_lost, __ATOMIC_RELAXED);
+    uint64_t busy = 0;
+    for (int s = 0; s < PEBS_NSCANNERS; s++) {
+        busy += __atomic_load_n(&pebs_shard_stats[s].busy_cycles, __ATOMIC_RELAXED);
+    }
+
+    uint64_t samples = (processed + shed) - last_samples;
+    double rate = samples / secs;
+    double util = 100.0 * (busy - last_busy) / ((double)(cur_cyc - last_cyc) * PEBS_NSCANNERS);
+    bool throttled = atomic_exchange_explicit(&throttle_seen, false, memory_order_relaxed);
+    bool losing = lost != last_lost || shed != last_shed;
+
+    int shift = atomic_load(&period_shift);
+    if (throttled || losing || rate > PEBS_TARGET_RATE * 1.25 || util > PEBS_SCAN_CPU_BUDGET) {
+        if (shift < PEBS_PERIOD_SHIFT_MAX) shift++;
+    } else if (rate < PEBS_TARGET_RATE / 2.0 && util < PEBS_SCAN_CPU_BUDGET / 2.0) {
+        if (shift > PEBS_PERIOD_SHIFT_MIN) shift--;
+    }
+    if (shift != atomic_load(&period_shift)) {
+        LOG_DEBUG("PEBS: period %lu -> %lu, rate: %.0f, util: %.1f, throttled: %d, losing: %d\n",
+            period_from_shift(atomic_load(&period_shift)), period_from_shift(shift), rate, util, throttled, losing);
+        atomic_store_explicit(&period_shift, shift, memory_order_release);
+    }
+    pebs_stats.sample_period = period_from_shift(shift);
+    pebs_stats.sample_rate = (uint64_t)rate;
+
+    last_time = now;
+    last_cyc = cur_cyc;
+    last_samples = processed + shed;
+    last_lost = lost;
+    last_shed = shed;
+    last_busy = busy;
+}
+
+// Each shard applies period changes to the events it owns
+static void apply_period(int shard, int shift) {
+    uint64_t period = period_from_shift(shift);
+    for (int cpu_idx = shard; cpu_idx < PEBS_NPROCS; cpu_idx += PEBS_NSCANNERS) {
+        if (!pebs_cpus[cpu_idx].active) continue;
+        for (int evt = 0; evt < PEBS_NRINGS; evt++) {
+            if (ioctl(pfd[cpu_idx][evt], PERF_EVENT_IOC_PERIOD, &period) == -1) {
+                perror("PERF_EVENT_IOC_PERIOD");
+            }
+        }
+    }
+}
+#endif
+
+#if PEBS_BLOCKING == 1
+static nfds_t build_pollfds(int shard, struct pollfd *fds) {
+    nfds_t nfds = 0;
+    for (int cpu_idx = shard; cpu_idx < PEBS_NPROCS; cpu_idx += PEBS_NSCANNERS) {
+        if (!pebs_cpus[cpu_idx].active) continue;
+        for (int evt = 0; evt < PEBS_NRINGS; evt++) {
+            fds[nfds++] = (struct pollfd) { .fd = pfd[cpu_idx][evt], .events = POLLIN };
+        }
+    }
+    return nfds;
+}
+#endif
+
+// Where a shard is in its pass over the rings it owns. A pass drains every
+// ring once, remote rings first so they get drained before anything is shed
+struct pebs_cursor {
+    int cpu_idx;                // slot being drained, -1 between passes
+    int ring;
+    bool in_ring;
+    uint64_t head, tail;        // snapshot of the ring being drained
+    uint32_t budget;
+    bool ring_overloaded;
+    uint64_t decoded, shed, foreign;
+    bool overloaded;            // a ring was over budget last pass, shed low priority samples
+    bool over_budget;
+    uint64_t last_rescan;
+#if PEBS_ADAPTIVE_PERIOD == 1
+    int applied_shift;
+#endif
+#if PEBS_BLOCKING == 1
+    nfds_t nfds;
+    struct pollfd fds[(PEBS_NPROCS / PEBS_NSCANNERS + 1) * PEBS_NRINGS];
+#endif
+} __attribute__((aligned(64)));
+
+static struct pebs_cursor pebs_cursors[PEBS_NSCANNERS];
+
+// Cpu and period bookkeeping done between passes
+static void pebs_pass_begin(int shard, struct pebs_cursor *c) {
+    // Follow affinity changes and cpu hotplug
+    if (shard == 0 && rdtscp() - c->last_rescan > PEBS_CPU_RESCAN_INTERVAL) {
+        rescan_cpus(true);
+        c->last_rescan = rdtscp();
+    }
+    if (reconcile_cpus(shard)) {
+#if PEBS_BLOCKING == 1
+        c->nfds = build_pollfds(shard, c->fds);
+#endif
+    }
+
+#if PEBS_ADAPTIVE_PERIOD == 1
+    if (shard == 0) period_controller();
+    int shift = atomic_load_explicit(&period_shift, memory_order_acquire);
+    if (shift != c->applied_shift) {
+        apply_period(shard, shift);
+        c->applied_shift = shift;
+    }
+#endif
+
+    c->over_budget = false;
+    c->cpu_idx = shard;
+    c->ring = PEBS_NRINGS;
+    c->in_ring = false;
+}
+
+// Snapshot the ring once, the kernel only ever appends past data_head. A
+// backlog over budget makes the shard shed low priority samples
+static void pebs_ring_begin(int shard, struct pebs_cursor *c) {
+    struct perf_event_mmap_page *p = perf_page[c->cpu_idx][c->ring];
+    struct pebs_shard_stats *sstats = &pebs_shard_stats[shard];
+
+    c->head = __atomic_load_n(&p->data_head, __ATOMIC_ACQUIRE);
+    c->tail = p->data_tail;
+
+    uint64_t backlog = (c->head - c->tail) / PERF_SAMPLE_REC_SIZE;
+    if (backlog > sstats->backlog) sstats->backlog = backlog;
+    c->ring_overloaded = c->overloaded || backlog > PEBS_RING_BUDGET;
+    c->over_budget |= backlog > PEBS_RING_BUDGET;
+
+    c->budget = PEBS_RING_BUDGET;
+    c->decoded = c->shed = c->foreign = 0;
+}
+
+static void pebs_ring_end(int shard, struct pebs_cursor *c) {
+    int cpu_idx = c->cpu_idx, evt = c->ring;
+
+    __atomic_fetch_add(&pebs_stats.shed_samples, c->shed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pebs_stats.foreign_samples, c->foreign, __ATOMIC_RELAXED);
+    pebs_shard_stats[shard].drops += c->shed;
+
+    if (c->decoded != 0) {
+        no_samples[cpu_idx][evt] = rdtscp();
     }
     no_samples[cpu_idx][evt]++;
-    p->data_tail = p->data_head;
 
     uint64_t cur_cyc = rdtscp();
     if (cur_cyc > no_samples[cpu_idx][evt] + NO_SAMPLE_RESET_TIME) {
-        pebs_stats.pebs_resets++;
+        STAT_INC(pebs_stats.pebs_resets);
         ioctl(pfd[cpu_idx][evt], PERF_EVENT_IOC_DISABLE);
         ioctl(pfd[cpu_idx][evt], PERF_EVENT_IOC_RESET);
         ioctl(pfd[cpu_idx][evt], PERF_EVENT_IOC_ENABLE);
         no_samples[cpu_idx][evt] = cur_cyc;
     }
-    // Run clustering algorithm
 }
 
+static uint32_t pebs_source_poll(int shard, struct pebs_sample *batch, uint32_t max) {
+    struct pebs_cursor *c = &pebs_cursors[shard];
+    if (c->cpu_idx < 0) pebs_pass_begin(shard, c);
+
+    while (c->cpu_idx < PEBS_NPROCS) {
+        if (!c->in_ring) {
+            if (c->ring == 0 || !pebs_cpus[c->cpu_idx].active) {
+                c->cpu_idx += PEBS_NSCANNERS;
+                c->ring = PEBS_NRINGS;
+                continue;
+            }
+            c->ring--;
+            pebs_ring_begin(shard, c);
+            c->in_ring = true;
+        }
+        if (c->tail == c->head) {
+            pebs_ring_end(shard, c);
+            c->in_ring = false;
+            continue;
+        }
+
+        struct perf_event_mmap_page *p = perf_page[c->cpu_idx][c->ring];
+        uint32_t n = decode_perf_buffer(p, c->cpu_idx, c->ring, batch, max, &c->tail, c->head,
+                                        c->ring_overloaded, &c->budget, &c->shed, &c->foreign);
+        // The batch is a copy, so the ring space can be handed back before the policy runs
+        __atomic_store_n(&p->data_tail, c->tail, __ATOMIC_RELEASE);
+        c->decoded += n;
+        if (n != 0) return n;
+    }
+
+    c->overloaded = c->over_budget;
+    c->cpu_idx = -1;
+    return 0;
+}
+
+static void pebs_source_wait(int shard, int timeout_ms) {
+#if PEBS_BLOCKING == 1
+    // Woken once a ring reaches PEBS_WAKEUP_EVENTS
+    struct pebs_cursor *c = &pebs_cursors[shard];
+    poll(c->fds, c->nfds, timeout_ms);
+#endif
+}
+
+static bool pebs_source_init(void) {
+    pebs_stats.sample_period = SAMPLE_PERIOD;
+
+    for (int slot = 0; slot < PEBS_NPROCS; slot++) {
+        atomic_store(&pebs_cpus[slot].cpu, -1);
+        for (int evt = 0; evt < PEBS_NRINGS; evt++) {
+            pfd[slot][evt] = -1;
+        }
+    }
+
+    // Only the main thread exists yet, start from its affinity
+    rescan_cpus(false);
+    for (int slot = 0; slot < PEBS_NPROCS; slot++) {
+        if (atomic_load(&pebs_cpus[slot].want) && !pebs_cpu_open(slot)) {
+            pebs_cpu_close(slot);
+        }
+    }
+
+    for (int shard = 0; shard < PEBS_NSCANNERS; shard++) {
+        struct pebs_cursor *c = &pebs_cursors[shard];
+        c->cpu_idx = -1;
+        c->last_rescan = rdtscp();
+#if PEBS_ADAPTIVE_PERIOD == 1
+        c->applied_shift = atomic_load(&period_shift);
+#endif
+#if PEBS_BLOCKING == 1
+        c->nfds = build_pollfds(shard, c->fds);
+#endif
+    }
+
+    if (pebs_stats.sampled_cpus == 0) {
+        fprintf(stderr, "PEBS: no cpus to sample\n");
+        return false;
+    }
+    return true;
+}
+
+static void pebs_source_teardown(void) {
+    for (int slot = 0; slot < PEBS_NPROCS; slot++) {
+        pebs_cpu_close(slot);
+    }
+}
+
+const struct sample_source pebs_source = {
+    .name = "pebs",
+    .init = pebs_source_init,
+    .poll = pebs_source_poll,
+    .wait = pebs_source_wait,
+    .teardown = pebs_source_teardown,
+};
+
+#if PEBS_PIPELINE == 1
+// Decode stage side. Samples that don't fit are dropped rather than waiting
+// on the policy stage, the perf rings are what must not back up
+static void pipeline_put(int shard, struct pebs_sample *batch, uint32_t n) {
+    struct pebs_shard_stats *sstats = &pebs_shard_stats[shard];
+    size_t put = ring_buf_put(policy_rings[shard], batch, n);
+    if (put < n) {
+        sstats->ring_full++;
+        sstats->ring_drops += n - put;
+    }
+    size_t waiting = ring_buf_size(policy_rings[shard]);
+    if (waiting > sstats->ring_hwm) sstats->ring_hwm = waiting;
+}
 
-void* pebs_scan_thread() {
+// Policy stage for one shard: lookups, hotness, cooling and the algorithm
+void* pebs_policy_thread(void *arg) {
     internal_call = true;
+    int shard = (int)(uintptr_t)arg;
+    internal_tids[POLICY_THREAD + shard] = syscall(SYS_gettid);
+    pin_shard_thread(pthread_self(), PEBS_POLICY_CPU + shard * PEBS_SCAN_CPU_STRIDE);
+
+    ring_handle_t ring = policy_rings[shard];
+    struct pebs_sample batch[PEBS_BATCH_SIZE];
+#if PEBS_BLOCKING == 1
+    uint64_t idle_loops = 0;
+#endif
+
+    while (true) {
+        size_t n = ring_buf_get(ring, batch, PEBS_BATCH_SIZE);
+        if (n != 0) {
+            uint64_t start = rdtscp();
+            process_samples(shard, batch, n);
+            __atomic_fetch_add(&pebs_shard_stats[shard].policy_cycles, rdtscp() - start, __ATOMIC_RELAXED);
+#if PEBS_BLOCKING == 1
+            idle_loops = 0;
+#endif
+            continue;
+        }
+#if PEBS_BLOCKING == 1
+        if (++idle_loops >= PEBS_SPIN_LOOPS) {
+            ring_buf_wait(ring, PEBS_POLL_TIMEOUT_MS);
+            idle_loops = 0;
+        }
+#endif
+    }
+    return NULL;
+}
+#endif
+
+void* pebs_scan_thread(void *arg) {
+    internal_call = true;
+    int shard = (int)(uintptr_t)arg;
+    internal_tids[PEBS_THREAD + shard] = syscall(SYS_gettid);
     // set cpu
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    CPU_SET(PEBS_SCAN_CPU, &cpuset);
-    // pthread_t thread_id = pthread_self();
-    int s = pthread_setaffinity_np(internal_threads[PEBS_THREAD], sizeof(cpu_set_t), &cpuset);
-    assert(s == 0);
+    pin_shard_thread(internal_threads[PEBS_THREAD + shard], PEBS_SCAN_CPU + shard * PEBS_SCAN_CPU_STRIDE);
     // pebs_init();
 
-    last_cyc_cool = rdtscp();
-
     // uint64_t num_loops = 0;
 
-    
-    while (true) {
-        CHECK_KILLED(PEBS_THREAD);
+    struct pebs_sample batch[PEBS_BATCH_SIZE];
+#if PEBS_BLOCKING == 1
+    uint64_t idle_loops = 0;
+#endif
 
-        int pebs_start_cpu = 0;
-        int num_cores = PEBS_NPROCS;
+    while (true) {
+        CHECK_KILLED(PEBS_THREAD + shard);
+
+        // One pass over what the source has for this shard
+        uint64_t pass_start = rdtscp();
+        uint64_t processed = 0;
+        uint32_t n;
+        while ((n = sample_source->poll(shard, batch, PEBS_BATCH_SIZE)) != 0) {
+            assert(n <= PEBS_BATCH_SIZE);
+            processed += n;
+#if PEBS_PIPELINE == 1
+            pipeline_put(shard, batch, n);
+#else
+            process_samples(shard, batch, n);
+#endif
+        }
+        if (processed != 0) {
+            __atomic_fetch_add(&pebs_stats.processed_samples, processed, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&pebs_shard_stats[shard].busy_cycles, rdtscp() - pass_start, __ATOMIC_RELAXED);
+        }
 
-        for (int cpu_idx = pebs_start_cpu; cpu_idx < pebs_start_cpu + num_cores; cpu_idx++) {
-            for(int evt = 0; evt < NPBUFTYPES; evt++) {
-                process_perf_buffer(cpu_idx, evt);
-            }
+#if PEBS_BLOCKING == 1
+        if (processed != 0) {
+            idle_loops = 0;
+        } else if (++idle_loops >= PEBS_SPIN_LOOPS) {
+            // Nothing for a while, sleep until the source has samples again
+            STAT_INC(pebs_stats.scan_sleeps);
+            sample_source->wait(shard, PEBS_POLL_TIMEOUT_MS);
+            idle_loops = 0;
         }
+#endif
     }
-    pebs_cleanup();
+    if (shard == 0) pebs_cleanup();
     return NULL;
 }
 
-void tmem_migrate_page(struct tmem_page *page, int node) {
+// Takes a page the migrate thread dequeued if it's still what it was queued
+// for, handing it PAGE_MIGRATING. The list bits still name the list it was
+// dequeued from, they're fixed up either way. gen is the generation it was
+// dequeued with, a page freed and recycled since is someone else's
+static bool migrate_begin(struct tmem_page *page, uint32_t gen, bool hot) {
+    uint32_t state;
+    if (!page_busy_begin(page, 0, &state)) return false;
+    if ((state & PAGE_GEN_MASK) != gen) {
+        page_busy_end(page, state);
+        return false;
+    }
+
+    // Back on a list means a request moved it after the dequeue
+    bool valid = page->cold->list == NULL;
+    if (hot) {
+        valid &= PAGE_WANTS_DRAM(page, state) != 0;
+    } else {
+        valid &= !(state & PAGE_REM);
+#if LRU_ALGO == 0
+        valid &= !(state & PAGE_HOT);
+#endif
+    }
+    state = PAGE_SET_LIST(state, page_list_id(page));
+    if (valid) state |= PAGE_MIGRATING;
+    page_busy_end(page, state);
+    return valid;
+}
+
+// Hands a page taken with migrate_begin back, on the given list
+static void migrate_end(struct tmem_page *page, uint32_t list, uint32_t set, uint32_t clear) {
+    // munmap waits for PAGE_MIGRATING to clear, so the page can't be freed here
+    bool live = page_state_set(page, set | (list << PAGE_LIST_SHIFT), clear | PAGE_MIGRATING | PAGE_LIST_MASK);
+    assert(live);
+}
+
+// Returns the bytes that moved into or out of DRAM
+uint64_t tmem_migrate_page(struct tmem_page *page, int node) {
+#if TMEM_FINE == 1
+    // Only the hot base pages go up, a partial move is still a migration
+    uint64_t bytes;
+    bool moved = fine_migrate(page, node, &bytes);
+#else
+    bool moved = true;
     unsigned long nodemask = 1UL << node;
+    uint64_t bytes = page->size;
 
     if (mbind(page->va_start, page->size, MPOL_BIND, &nodemask, 64, MPOL_MF_MOVE | MPOL_MF_STRICT) == -1) {
         perror("mbind");
         printf("mbind failed %p\n", page->va_start);
+        moved = false;
+        bytes = 0;
+    }
+#endif
+    if (!moved) {
+        migrate_end(page, LIST_NONE, 0, 0);
     } else {
         if (node == DRAM_NODE) {
             // was migrated to dram
-            page->in_dram = IN_DRAM;
 #if LRU_ALGO == 1
-            page->hot = false;
             enqueue_fifo(&cold_list, page);
+            migrate_end(page, LIST_COLD, PAGE_MIGRATED, PAGE_REM | PAGE_HOT);
 #else
-            page->hot = true;
             enqueue_fifo(&hot_list, page);
+            migrate_end(page, LIST_HOT, PAGE_MIGRATED | PAGE_HOT, PAGE_REM);
 #endif
 #if RECORD == 1
             struct pebs_rec p_rec = {
@@ -514,15 +1462,16 @@ void tmem_migrate_page(struct tmem_page *page, int node) {
             };
             fwrite(&p_rec, sizeof(struct pebs_rec), 1, cold_fp);
 #endif
-            page->in_dram = IN_REM;
-            page->hot = false;
+            migrate_end(page, LIST_NONE, PAGE_MIGRATED | PAGE_REM, PAGE_HOT);
         }
     }
+    return bytes;
 }
 
 
 void *migrate_thread() {
     internal_call = true;
+    internal_tids[MIGRATE_THREAD] = syscall(SYS_gettid);
 
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
@@ -532,59 +1481,100 @@ void *migrate_thread() {
     // uint64_t num_loops = 0;
 
     struct tmem_page *hot_page, *cold_page;
+    uint32_t hot_gen, cold_gen;
     uint64_t cold_bytes = 0;
+#if PEBS_STORES == 1
+    uint32_t write_skips = 0;
+#endif
+#if PEBS_BLOCKING == 1
+    uint64_t idle_loops = 0;
+    bool woke = false;
+#endif
 
     while (true) {
         // CHECK_KILLED(MIGRATE_THREAD);
 
-        // Don't do any migrations until hot page comes in
-        hot_page = dequeue_fifo(&hot_list);
-        if (hot_page == NULL) continue;
-        pthread_mutex_lock(&hot_page->page_lock);
-
-        assert(hot_page != NULL);
-        if (hot_page->list != NULL || hot_page->in_dram == IN_DRAM) {
-            pthread_mutex_unlock(&hot_page->page_lock);
+        // Don't do any migrations until hot page comes in. From the dequeue
+        // until it's PAGE_MIGRATING only the epoch keeps an munmapped page
+        // from being recycled or its slab from being given back
+        epoch_enter();
+        hot_page = dequeue_fifo_gen(&hot_list, &hot_gen);
+        bool taken = hot_page != NULL && migrate_begin(hot_page, hot_gen, true);
+        epoch_exit();
+        if (hot_page == NULL) {
+#if PEBS_BLOCKING == 1
+            if (++idle_loops >= MIGRATE_SPIN_LOOPS) {
+                // Woken by enqueue_fifo on the hot list, timeout only bounds a missed wakeup
+                if (wait_fifo(&hot_list, PEBS_POLL_TIMEOUT_MS)) {
+                    STAT_INC(pebs_stats.mig_sleeps);
+                    woke = true;
+                }
+                idle_loops = 0;
+            }
+#endif
             continue;
         }
+#if PEBS_BLOCKING == 1
+        idle_loops = 0;
+#endif
+        assert(hot_page != NULL);
+        if (!taken) continue;
         
         LOG_DEBUG("MIG: got hot page: 0x%lx\n", hot_page->va);
 
         uint64_t mig_queue_cyc = rdtscp();
-        uint64_t mig_queue_diff = mig_queue_cyc - hot_page->mig_start;
+        uint64_t mig_queue_diff = mig_queue_cyc - hot_page->cold->mig_start;
+#if PEBS_BLOCKING == 1
+        if (woke) {
+            // Promotion latency added by sleeping instead of spinning
+            if (mig_queue_diff > __atomic_load_n(&pebs_stats.max_wake_latency, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&pebs_stats.max_wake_latency, mig_queue_diff, __ATOMIC_RELAXED);
+            }
+            woke = false;
+        }
+#endif
         mig_queue_time = DEC_MIG_TIME * mig_queue_diff + (1.0 - DEC_MIG_TIME) * mig_queue_time;
 
         // have a valid hot page. Now get cold pages
         // disable dram mmap temporarily
         atomic_store_explicit(&dram_lock, true, memory_order_release);
         uint64_t bytes_free = dram_size - __atomic_load_n(&dram_used, __ATOMIC_ACQUIRE);
+#if TMEM_FINE == 1
+        uint64_t need = fine_promote_bytes(hot_page);
+#else
+        uint64_t need = hot_page->size;
+#endif
 
-        if (bytes_free >= hot_page->size) {
+        if (bytes_free >= need) {
             LOG_DEBUG("MIG: enough dram: 0x%lx\n", hot_page->va);
             // Enough space in dram, just migrate hot page
             // tmem_migrate_pages(&hot_page, 1, DRAM_NODE);
-            tmem_migrate_page(hot_page, DRAM_NODE);
-            hot_page->migrated = true;
-            pebs_stats.promotions++;
+            uint64_t size = tmem_migrate_page(hot_page, DRAM_NODE);
+            STAT_INC(pebs_stats.promotions);
             
-            __atomic_fetch_add(&dram_used, hot_page->size, __ATOMIC_RELEASE);
+            __atomic_fetch_add(&dram_used, size, __ATOMIC_RELEASE);
             atomic_store_explicit(&dram_lock, false, memory_order_release);
             LOG_DEBUG("MIG: Finished migration: 0x%lx\n", hot_page->va);
             uint64_t mig_move_diff = rdtscp() - mig_queue_cyc;
             mig_move_time = DEC_MIG_TIME * mig_move_diff + (1.0 - DEC_MIG_TIME) * mig_move_time;
-
-            pthread_mutex_unlock(&hot_page->page_lock);
             continue;
         }
 
         cold_bytes = 0;
+#if PEBS_STORES == 1
+        write_skips = 0;
+#endif
         // Not enough space in dram, demote cold pages until enough space
-        while (bytes_free + cold_bytes < hot_page->size) {
-            cold_page = dequeue_fifo(&cold_list);
+        while (bytes_free + cold_bytes < need) {
+            epoch_enter();
+            cold_page = dequeue_fifo_gen(&cold_list, &cold_gen);
+            taken = cold_page != NULL && migrate_begin(cold_page, cold_gen, false);
+            epoch_exit();
             if (cold_page == NULL) {
                 // cold list is empty, abort
                 // enqueue_fifo(&hot_list, hot_page);
-                pthread_mutex_unlock(&hot_page->page_lock);
+                // Left off the hot list, the next hot request queues it again
+                migrate_end(hot_page, LIST_NONE, 0, 0);
 
                 // enable dram mmap with updated dram_used
                 __atomic_fetch_sub(&dram_used, cold_bytes, __ATOMIC_RELEASE);
@@ -594,51 +1584,57 @@ void *migrate_thread() {
                 break;
             }
             assert(cold_page != NULL);
-            pthread_mutex_lock(&cold_page->page_lock);
-#if LRU_ALGO == 1
-            if (cold_page->list != NULL) {
-#else
-            if (cold_page->list != NULL || cold_page->in_dram == IN_REM || cold_page->hot) {
-#endif
+            if (!taken) {
                 // page got yoinked
-                pthread_mutex_unlock(&cold_page->page_lock);
                 continue;
             }
-            assert(cold_page->in_dram == IN_DRAM);
-            // assert(!cold_page->hot);
-            assert(cold_page->list == NULL);
+            assert(cold_page->cold->list == NULL);
+#if PEBS_STORES == 1
+            // Prefer demoting read-mostly pages, writes to the slow tier cost more
+            if (PAGE_WRITE_HOT(cold_page) && write_skips < COLD_WRITE_SKIP) {
+                write_skips++;
+                STAT_INC(pebs_stats.write_skips);
+                enqueue_fifo(&cold_list, cold_page);
+                migrate_end(cold_page, LIST_COLD, 0, 0);
+                continue;
+            }
+#endif
 
             // tmem_migrate_pages(&cold_page, 1, REM_NODE);
-            tmem_migrate_page(cold_page, REM_NODE);
-            cold_page->migrated = true;
-            cold_bytes += cold_page->size;
+            cold_bytes += tmem_migrate_page(cold_page, REM_NODE);
             LOG_DEBUG("MIG: demoted 0x%lx\n", cold_page->va);
-            pthread_mutex_unlock(&cold_page->page_lock);
-            pebs_stats.demotions++;
+            STAT_INC(pebs_stats.demotions);
         }
         if (cold_page == NULL) continue;
         // now enough space in dram
         LOG_DEBUG("MIG: now enough space: 0x%lx\n", hot_page->va);
         // tmem_migrate_pages(&hot_page, 1, DRAM_NODE);
-        tmem_migrate_page(hot_page, DRAM_NODE);
-        hot_page->migrated = true;
-        pebs_stats.promotions++;
+        uint64_t size = tmem_migrate_page(hot_page, DRAM_NODE);
+        STAT_INC(pebs_stats.promotions);
 
         // enable dram mmap
-        __atomic_fetch_add(&dram_used, hot_page->size - cold_bytes, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&dram_used, size - cold_bytes, __ATOMIC_RELEASE);
         atomic_store_explicit(&dram_lock, false, memory_order_release);
         LOG_DEBUG("MIG: Finished migration: 0x%lx\n", hot_page->va);
 
         uint64_t mig_move_diff = rdtscp() - mig_queue_cyc;
         mig_move_time = DEC_MIG_TIME * mig_move_diff + (1.0 - DEC_MIG_TIME) * mig_move_time;
-
-        pthread_mutex_unlock(&hot_page->page_lock);
     }
 }
 
 void start_pebs_thread() {
-    int s = pthread_create(&internal_threads[PEBS_THREAD], NULL, pebs_scan_thread, NULL);
-    assert(s == 0);
+    atomic_store(&last_cyc_cool, rdtscp());
+#if PEBS_PIPELINE == 1
+    for (int shard = 0; shard < PEBS_NSCANNERS; shard++) {
+        policy_rings[shard] = ring_buf_init(sizeof(struct pebs_sample), PEBS_PIPELINE_SLOTS);
+        int s = pthread_create(&internal_threads[POLICY_THREAD + shard], NULL, pebs_policy_thread, (void *)(uintptr_t)shard);
+        assert(s == 0);
+    }
+#endif
+    for (int shard = 0; shard < PEBS_NSCANNERS; shard++) {
+        int s = pthread_create(&internal_threads[PEBS_THREAD + shard], NULL, pebs_scan_thread, (void *)(uintptr_t)shard);
+        assert(s == 0);
+    }
 }
 
 void start_migrate_thread() {
@@ -658,20 +1654,16 @@ void pebs_init(void) {
     start_pebs_stats_thread();
 #endif
 
+    tracked_pid = getpid();
+
     tmem_trace_fp = fopen("tmem_trace.bin", "wb");
     if (tmem_trace_fp == NULL) {
         perror("tmem_trace file fopen");
     }
     assert(tmem_trace_fp != NULL);
 
-    int pebs_start_cpu = 0;
-    int num_cores = PEBS_NPROCS;
-    
-    for (int i = pebs_start_cpu; i < pebs_start_cpu + num_cores; i++) {
-        perf_page[i][DRAMREAD] = perf_setup(0x1d3, 0, i, i * 2, DRAMREAD);      // MEM_LOAD_L3_MISS_RETIRED.LOCAL_DRAM, mem_load_uops_l3_miss_retired.local_dram
-        perf_page[i][REMREAD] = perf_setup(0x4d3, 0, i, i * 2, REMREAD);     //  mem_load_uops_l3_miss_retired.remote_dram
-        no_samples[i][DRAMREAD] = 0;
-        no_samples[i][REMREAD] = 0;
+    if (!sample_source->init()) {
+        fprintf(stderr, "%s sample source failed to start, no samples will be taken\n", sample_source->name);
     }
 
     start_pebs_thread();
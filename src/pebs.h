@@ -22,6 +22,8 @@
 #include <stdlib.h>
 #include <sched.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <dirent.h>
 
 #include "timer.h"
 #include "interpose.h"
@@ -38,10 +40,36 @@
     #define PEBS_SCAN_CPU 2
 #endif
 
+// Number of scanner threads. Shard s owns every PEBS_NSCANNERS'th cpu_idx
+// starting at s and is pinned to PEBS_SCAN_CPU + s * PEBS_SCAN_CPU_STRIDE,
+// wrapped onto the cpus the process may run on
+#ifndef PEBS_NSCANNERS
+    #define PEBS_NSCANNERS 1
+#endif
+
+#ifndef PEBS_SCAN_CPU_STRIDE
+    #define PEBS_SCAN_CPU_STRIDE 6  // 2, 8, 14, ... stays clear of stats/migrate cpus
+#endif
+
 #ifndef PEBS_STATS_CPU
     #define PEBS_STATS_CPU 4
 #endif
 
+// 1: each shard hands decoded samples to its own policy thread through an
+// SPSC ring of PEBS_PIPELINE_SLOTS, so the algorithm doesn't hold up ring
+// draining. Policy thread s is pinned to PEBS_POLICY_CPU + s * PEBS_SCAN_CPU_STRIDE
+#ifndef PEBS_PIPELINE
+    #define PEBS_PIPELINE 0
+#endif
+
+#ifndef PEBS_PIPELINE_SLOTS
+    #define PEBS_PIPELINE_SLOTS 16384
+#endif
+
+#ifndef PEBS_POLICY_CPU
+    #define PEBS_POLICY_CPU 3
+#endif
+
 #ifndef MIGRATE_CPU
     #define MIGRATE_CPU 6
 #endif
@@ -50,18 +78,118 @@
     #define SAMPLE_PERIOD 3200
 #endif
 
+// 1: per-cpu events bound to this process and inherited by its new threads,
+// opened on every online cpu of the cpuset rather than following affinity
+// 0: system-wide per-cpu events. Either way samples from other processes and
+// from internal threads are filtered by PERF_SAMPLE_TID before any lookup
+#ifndef PEBS_TASK_MODE
+    #define PEBS_TASK_MODE 0
+#endif
+
+// Max samples decoded from a ring per pass
+#ifndef PEBS_BATCH_SIZE
+    #define PEBS_BATCH_SIZE 256
+#endif
+
+// Max samples handed to the policy per ring per pass. Samples past the
+// budget, and DRAMREAD samples while overloaded, are shed
+#ifndef PEBS_RING_BUDGET
+    #define PEBS_RING_BUDGET 2048
+#endif
+
+// Spin-then-block: after PEBS_SPIN_LOOPS empty passes the scanner sleeps in
+// poll() on its perf fds, and the migrate thread sleeps on the hot list
+#ifndef PEBS_BLOCKING
+    #define PEBS_BLOCKING 0
+#endif
+
+#ifndef PEBS_SPIN_LOOPS
+    #define PEBS_SPIN_LOOPS 1024
+#endif
+
+#ifndef MIGRATE_SPIN_LOOPS
+    #define MIGRATE_SPIN_LOOPS 65536
+#endif
+
+// Samples per ring before the kernel wakes a sleeping scanner
+#ifndef PEBS_WAKEUP_EVENTS
+    #define PEBS_WAKEUP_EVENTS 32
+#endif
+
+// Upper bound on a sleep so idle rings still get the no-sample reset check
+#ifndef PEBS_POLL_TIMEOUT_MS
+    #define PEBS_POLL_TIMEOUT_MS 10
+#endif
+
+// Runtime sample period controller. The period is SAMPLE_PERIOD scaled by a
+// power of two chosen every PEBS_CTRL_INTERVAL cycles to keep the total
+// sample rate near PEBS_TARGET_RATE samples/sec and scanner utilization
+// under PEBS_SCAN_CPU_BUDGET percent
+#ifndef PEBS_ADAPTIVE_PERIOD
+    #define PEBS_ADAPTIVE_PERIOD 0
+#endif
+
+#ifndef PEBS_TARGET_RATE
+    #define PEBS_TARGET_RATE 200000
+#endif
+
+#ifndef PEBS_SCAN_CPU_BUDGET
+    #define PEBS_SCAN_CPU_BUDGET 50
+#endif
+
+#ifndef PEBS_CTRL_INTERVAL
+    #define PEBS_CTRL_INTERVAL 1000000000UL
+#endif
+
+#ifndef PEBS_PERIOD_SHIFT_MIN
+    #define PEBS_PERIOD_SHIFT_MIN -4
+#endif
+
+#ifndef PEBS_PERIOD_SHIFT_MAX
+    #define PEBS_PERIOD_SHIFT_MAX 10
+#endif
+
 #ifndef PERF_PAGES
     #define PERF_PAGES (1 + (1 << 4))  // Uses 8GB total for 16 CPUs
 #endif
 
+// Max number of cpus sampled at once. The sampled cpus are discovered from
+// the application's affinity, its cpuset and the online cpus, and rescanned
+// every PEBS_CPU_RESCAN_INTERVAL cycles
 #ifndef PEBS_NPROCS
-    #define PEBS_NPROCS 16
+    #define PEBS_NPROCS 256
+#endif
+
+#ifndef PEBS_CPU_RESCAN_INTERVAL
+    #define PEBS_CPU_RESCAN_INTERVAL 3000000000UL
 #endif
 
 #ifndef HOT_THRESHOLD
     #define HOT_THRESHOLD 8
 #endif
 
+// 1: samples carry PERF_SAMPLE_WEIGHT and tmem_page.accesses accumulates
+// load latency in cycles instead of a sample count. Only the load latency
+// event fills in the weight, so with PEBS samples it needs PEBS_DATA_SRC.
+// Samples without a latency (stores, other sample sources) are charged the
+// nominal latency of the tier they hit
+#ifndef PEBS_WEIGHTED_HOTNESS
+    #define PEBS_WEIGHTED_HOTNESS 0
+#endif
+
+#ifndef DRAM_LATENCY
+    #define DRAM_LATENCY 250
+#endif
+
+#ifndef REM_LATENCY
+    #define REM_LATENCY 500
+#endif
+
+// Latency weighted equivalent of HOT_THRESHOLD
+#ifndef HOT_WEIGHT_THRESHOLD
+    #define HOT_WEIGHT_THRESHOLD (HOT_THRESHOLD * REM_LATENCY)
+#endif
+
 #ifndef SAMPLE_COOLING_THRESHOLD
     #define SAMPLE_COOLING_THRESHOLD 100000
 #endif
@@ -75,19 +203,152 @@
 #endif
 
 enum {
-    PEBS_THREAD,
     PEBS_STATS_THREAD,
     MIGRATE_THREAD,
-    NUM_INTERNAL_THREADS
+    PEBS_THREAD,    // first scanner shard, one thread per shard follows
+    POLICY_THREAD = PEBS_THREAD + PEBS_NSCANNERS,   // first policy stage with PEBS_PIPELINE
+    NUM_INTERNAL_THREADS = POLICY_THREAD + PEBS_PIPELINE * PEBS_NSCANNERS
 };
 
 
 enum pbuftype {
   DRAMREAD = 0,
   REMREAD = 1,  
+  STOREWRITE = 2,
   NPBUFTYPES
 };
 
+// 1: one load latency event per cpu, each sample's tier comes from
+// PERF_SAMPLE_DATA_SRC instead of from which of two events fired
+#ifndef PEBS_DATA_SRC
+    #define PEBS_DATA_SRC 0
+#endif
+
+// Load latency threshold in cycles, loads faster than this are not sampled
+#ifndef PEBS_LDLAT
+    #define PEBS_LDLAT 64
+#endif
+
+// 1: also sample stores (MEM_INST_RETIRED.ALL_STORES) into a ring of their own
+#ifndef PEBS_STORES
+    #define PEBS_STORES 0
+#endif
+
+// A store sample adds WRITE_WEIGHT times what a load sample adds to a page's
+// hotness, and the migrate thread passes over write-hot pages when picking
+// pages to demote (up to COLD_WRITE_SKIP times per promotion)
+#ifndef WRITE_WEIGHT
+    #define WRITE_WEIGHT 2
+#endif
+
+#ifndef COLD_WRITE_SKIP
+    #define COLD_WRITE_SKIP 16
+#endif
+
+#if PEBS_DATA_SRC == 1
+    #define PEBS_NLOAD_RINGS 1
+#else
+    #define PEBS_NLOAD_RINGS 2
+#endif
+#define PEBS_NRINGS (PEBS_NLOAD_RINGS + PEBS_STORES)
+
+// Sample sources, PEBS samples this process, REPLAY feeds a RECORD=1 trace back
+// in at TRACE_REPLAY_SPEED times the recorded rate (0: as fast as possible),
+// IDLE tests and clears the idle bits of tracked pages every
+// IDLE_SCAN_INTERVAL_MS (needs CAP_SYS_ADMIN for pagemap PFNs), HINT
+// takes a hinting fault on the first write to pages it write protected, DAMON
+// reads region access frequencies from a kdamond monitoring this process
+#define SOURCE_PEBS 0
+#define SOURCE_REPLAY 1
+#define SOURCE_IDLE 2
+#define SOURCE_HINT 3
+#define SOURCE_DAMON 4
+
+#ifndef SAMPLE_SOURCE
+    #define SAMPLE_SOURCE SOURCE_PEBS
+#endif
+
+#if PEBS_WEIGHTED_HOTNESS == 1 && PEBS_DATA_SRC == 0 && SAMPLE_SOURCE == SOURCE_PEBS
+#error "PEBS_WEIGHTED_HOTNESS needs PEBS_DATA_SRC, the L3 miss events report no latency"
+#endif
+
+#ifndef TRACE_REPLAY_FILE
+    #define TRACE_REPLAY_FILE "tmem_replay.bin"
+#endif
+
+#ifndef TRACE_REPLAY_SPEED
+    #define TRACE_REPLAY_SPEED 1.0
+#endif
+
+#define TRACE_REPLAY_CHUNK 4096
+
+#ifndef IDLE_SCAN_INTERVAL_MS
+    #define IDLE_SCAN_INTERVAL_MS 1000
+#endif
+
+// A page in DRAM untouched for this many scans in a row is made cold
+#ifndef IDLE_COLD_SCANS
+    #define IDLE_COLD_SCANS 2
+#endif
+
+// Hinting faults. Every HINT_SCAN_INTERVAL_MS the next tracked writable pages
+// in turn are write protected through a userfaultfd (needs CAP_SYS_PTRACE,
+// vm.unprivileged_userfaultfd or access to /dev/userfaultfd), at most
+// HINT_FAULT_BUDGET per second and HINT_MAX_ARMED at a time. A page not
+// written within HINT_ARM_TIMEOUT_MS is released, and made cold if it's in DRAM
+#ifndef HINT_SCAN_INTERVAL_MS
+    #define HINT_SCAN_INTERVAL_MS 100
+#endif
+
+#ifndef HINT_FAULT_BUDGET
+    #define HINT_FAULT_BUDGET 1000
+#endif
+
+#ifndef HINT_MAX_ARMED
+    #define HINT_MAX_ARMED 64
+#endif
+
+#ifndef HINT_ARM_TIMEOUT_MS
+    #define HINT_ARM_TIMEOUT_MS 1000
+#endif
+
+// DAMON. Regions are read back every DAMON_READ_INTERVAL_MS, each tracked
+// page in a region gets the region's nr_accesses. Pages in DRAM in a region
+// with no accesses for DAMON_COLD_AGE aggregation intervals are made cold
+#ifndef DAMON_READ_INTERVAL_MS
+    #define DAMON_READ_INTERVAL_MS 1000
+#endif
+
+#ifndef DAMON_SAMPLE_US
+    #define DAMON_SAMPLE_US 5000
+#endif
+
+#ifndef DAMON_AGGR_US
+    #define DAMON_AGGR_US 100000
+#endif
+
+#ifndef DAMON_UPDATE_US
+    #define DAMON_UPDATE_US 1000000
+#endif
+
+#ifndef DAMON_MIN_REGIONS
+    #define DAMON_MIN_REGIONS 10
+#endif
+
+#ifndef DAMON_MAX_REGIONS
+    #define DAMON_MAX_REGIONS 1000
+#endif
+
+#ifndef DAMON_COLD_AGE
+    #define DAMON_COLD_AGE 10
+#endif
+
+// PAGE_SIZE windows one poll walks at most, tracked or not, so a huge
+// region doesn't hold the epoch for the whole walk. The next poll resumes
+#ifndef DAMON_POLL_STEPS
+    #define DAMON_POLL_STEPS 4096
+#endif
+
 struct pebs_rec {
   uint64_t cyc;
   uint64_t va;
@@ -96,21 +357,98 @@ struct pebs_rec {
   uint8_t  evt;
 } __attribute__((packed));
 
+// Sample decoded from a perf ring, handed to the policy stage in batches
+struct pebs_sample {
+  uint64_t addr;
+  uint64_t ip;
+  uint64_t time;        // TSC cycles, like rdtscp()
+  uint32_t tid;
+  uint32_t weight;      // load latency in cycles, 0 if unknown
+  uint32_t cpu_idx;
+  uint32_t count;       // accesses the sample stands for, 0 counts as 1
+  uint8_t  evt;
+};
+
+// A source of access samples for the scanner shards. poll fills batch with up
+// to max samples for a shard, returning 0 once the shard's pass is done. wait
+// blocks until the shard may have samples again, or timeout_ms passes
+struct sample_source {
+    const char *name;
+    bool (*init)(void);
+    uint32_t (*poll)(int shard, struct pebs_sample *batch, uint32_t max);
+    void (*wait)(int shard, int timeout_ms);
+    void (*teardown)(void);
+};
+
+extern const struct sample_source pebs_source;
+extern const struct sample_source replay_source;
+extern const struct sample_source idle_source;
+extern const struct sample_source hint_source;
+extern const struct sample_source damon_source;
+
 struct pebs_stats {
     uint64_t throttles, unthrottles;
     uint64_t local_accesses, remote_accesses;
     uint64_t internal_mem_overhead, mem_allocated;
     uint64_t unknown_samples;
+    uint64_t processed_samples;     // handed to the policy
+    uint64_t shed_samples;          // decoded but skipped by load shedding
+    uint64_t kernel_lost;           // reported by PERF_RECORD_LOST
+    uint64_t foreign_samples;       // other processes or internal threads
+    uint64_t unresolved_samples;    // handed to the policy but not inside any tracked page
     uint64_t wrapped_records;
     uint64_t wrapped_headers;
     uint64_t dram_accesses, rem_accesses;
+    uint64_t cxl_accesses, cache_hits;  // PEBS_DATA_SRC only, cxl_accesses are also in rem_accesses
+    uint64_t dram_stores, rem_stores;
+    uint64_t write_skips;           // write-hot pages passed over for demotion
+    uint64_t dram_stall_cycles, rem_stall_cycles;
     uint64_t promotions, demotions;
     uint64_t pebs_resets;
     uint64_t non_tracked_mem;
+    uint64_t lazy_ranges;           // mappings tracked lazily so far
+    uint64_t lazy_pages;            // pages made on demand inside them
+    uint64_t mremaps, mprotects;    // of tracked memory
+    uint64_t madvise_drops;         // DRAM pages MADV_DONTNEED/MADV_REMOVE took out of dram_used
+    uint64_t heap_grows;            // brk growths tracked
+    uint64_t scan_sleeps, mig_sleeps;
+    uint64_t max_wake_latency;      // cycles from hot request to dequeue after a migrate thread sleep
+    uint64_t sample_period;         // current period of every event
+    uint64_t sample_rate;           // samples/sec seen by the period controller
+    uint64_t sampled_cpus;
+    uint64_t cpu_adds, cpu_removes;
+    uint64_t page_scans;            // SOURCE_IDLE and SOURCE_DAMON only
+    uint64_t scanned_accessed, scanned_idle;
+    uint64_t hint_armed, hint_faults, hint_timeouts;   // SOURCE_HINT only
+    uint64_t fine_promotions, fine_demotions;           // TMEM_FINE only, base pages moved
+    uint64_t malloc_extent_allocs, malloc_extent_frees; // TMEM_MALLOC only, extents committed and given back
 };
 
+// Per scanner shard, padded so shards don't share cache lines
+struct pebs_shard_stats {
+    uint64_t samples;   // samples processed
+    uint64_t backlog;   // max records waiting in a ring when scanned
+    uint64_t drops;     // samples shed under overload
+    uint64_t busy_cycles;   // cumulative cycles spent in passes that found data
+    uint64_t ring_full;     // PEBS_PIPELINE: puts that found the policy ring full
+    uint64_t ring_drops;    // samples that didn't fit
+    uint64_t ring_hwm;      // most samples waiting in the policy ring
+    uint64_t policy_cycles; // cumulative cycles spent in the policy stage
+} __attribute__((aligned(64)));
+
+#define STAT_INC(x) __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+// Reads a counter and resets it in one step, for the per interval stats
+#define STAT_TAKE(x) __atomic_exchange_n(&(x), 0, __ATOMIC_RELAXED)
+
 extern struct pebs_stats pebs_stats;
+extern struct pebs_shard_stats pebs_shard_stats[PEBS_NSCANNERS];
+extern _Atomic int period_shift;
+
 
+struct tmem_page;
+void make_hot_request(struct tmem_page* page);
+void make_cold_request(struct tmem_page* page);
+void hint_untrack(uint64_t start, uint64_t end);
 
 void pebs_init();
 void start_pebs_thread();
@@ -0,0 +1,101 @@
+#include "pebs.h"
+
+// Feeds pebs_rec records, as written to tmem_trace.bin with RECORD=1, back
+// into the policy as if they had just been sampled. Shards share one reader
+static struct {
+    pthread_mutex_t lock;
+    FILE *fp;
+    struct pebs_rec buf[TRACE_REPLAY_CHUNK];
+    uint32_t pos, len;
+    bool started, done;
+    uint64_t first_cyc;     // cyc of the first record
+    uint64_t start_cyc;     // when the first record was replayed
+} replay = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Samples handed to each shard since its last pass ended
+static uint32_t replay_pass[PEBS_NSCANNERS];
+
+static bool replay_init(void) {
+    replay.fp = fopen(TRACE_REPLAY_FILE, "rb");
+    if (replay.fp == NULL) {
+        perror("replay file fopen");
+        replay.done = true;
+        return false;
+    }
+    LOG_DEBUG("replay: %s at %.2fx\n", TRACE_REPLAY_FILE, (double)TRACE_REPLAY_SPEED);
+    return true;
+}
+
+static uint32_t replay_poll(int shard, struct pebs_sample *batch, uint32_t max) {
+    // End the pass every PEBS_RING_BUDGET samples like a full ring would
+    if (replay_pass[shard] >= PEBS_RING_BUDGET) {
+        replay_pass[shard] = 0;
+        return 0;
+    }
+
+    uint32_t n = 0;
+    pthread_mutex_lock(&replay.lock);
+    while (n < max && !replay.done) {
+        if (replay.pos == replay.len) {
+            replay.len = fread(replay.buf, sizeof(struct pebs_rec), TRACE_REPLAY_CHUNK, replay.fp);
+            replay.pos = 0;
+            if (replay.len == 0) {
+                fprintf(stderr, "replay: reached the end of %s\n", TRACE_REPLAY_FILE);
+                replay.done = true;
+                break;
+            }
+        }
+
+        struct pebs_rec *rec = &replay.buf[replay.pos];
+        if (!replay.started) {
+            replay.first_cyc = rec->cyc;
+            replay.start_cyc = rdtscp();
+            replay.started = true;
+        }
+        // Hold the record until its offset into the trace has passed
+        if (TRACE_REPLAY_SPEED > 0 && rec->cyc > replay.first_cyc &&
+            (rec->cyc - replay.first_cyc) / TRACE_REPLAY_SPEED > rdtscp() - replay.start_cyc) {
+            break;
+        }
+
+        batch[n++] = (struct pebs_sample) {
+            .addr = rec->va,
+            .ip = rec->ip,
+            .time = rec->cyc,
+            .tid = 0,
+            .weight = 0,
+            .cpu_idx = rec->cpu,
+            .evt = rec->evt
+        };
+        replay.pos++;
+    }
+    pthread_mutex_unlock(&replay.lock);
+
+    if (n == 0) replay_pass[shard] = 0;
+    else replay_pass[shard] += n;
+    return n;
+}
+
+static void replay_wait(int shard, int timeout_ms) {
+    // Records come due without any event to wait on, so only nap while more are coming
+    bool done = __atomic_load_n(&replay.done, __ATOMIC_RELAXED);
+    usleep((done ? timeout_ms : 1) * 1000);
+}
+
+static void replay_teardown(void) {
+    pthread_mutex_lock(&replay.lock);
+    if (replay.fp != NULL) {
+        fclose(replay.fp);
+        replay.fp = NULL;
+    }
+    replay.done = true;
+    pthread_mutex_unlock(&replay.lock);
+}
+
+const struct sample_source replay_source = {
+    .name = "replay",
+    .init = replay_init,
+    .poll = replay_poll,
+    .wait = replay_wait,
+    .teardown = replay_teardown,
+};
@@ -1,59 +1,48 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "spsc-ring.h"
 #include "pebs.h"
 
+// head and tail only ever grow, the slot is the count masked by capacity.
+// Producer and consumer fields sit on their own cache lines, and each side
+// keeps a cached copy of the other's index so it only touches the shared
+// line when the cached one says the ring is full or empty
 struct ring_buf_t {
-	uint64_t** buffer;
-	size_t head;
-	size_t tail;
-	size_t capacity;
-};
-
-static void advance_pointer(ring_handle_t rbuf)
-{
-	assert(rbuf);
-
-	if(ring_buf_full(rbuf))
-    {
-    	if(++(rbuf->tail) == rbuf->capacity)
-    	{
-    		rbuf->tail = 0;
-    	}
-    }
-
-    if(++(rbuf->head) == rbuf->capacity)
-	{
-		rbuf->head = 0;
-	}
-}
+	_Atomic size_t head __attribute__((aligned(64)));	// written by the producer
+	size_t tail_cache;
+	uint32_t seq;		// bumped on a put while the consumer waits, futex word for ring_buf_wait
 
-static void retreat_pointer(ring_handle_t rbuf)
-{
-	assert(rbuf);
+	_Atomic size_t tail __attribute__((aligned(64)));	// written by the consumer
+	size_t head_cache;
+	uint32_t waiters;
 
-	if(++(rbuf->tail) == rbuf->capacity)
-	{
-		rbuf->tail = 0;
-	}
-}
+	char *buffer __attribute__((aligned(64)));
+	size_t capacity;	// power of two
+	size_t elem_size;
+};
 
-ring_handle_t ring_buf_init(uint64_t** buffer, size_t size)
+ring_handle_t ring_buf_init(size_t elem_size, size_t capacity)
 {
-	assert(buffer && size);
-
-	ring_handle_t rbuf = malloc(sizeof(ring_buf_t));
-	pebs_stats.internal_mem_overhead += sizeof(ring_buf_t);
-	LOG_DEBUG("RING: size: %lu\n", sizeof(ring_buf_t));
+	assert(elem_size && capacity);
+	assert((capacity & (capacity - 1)) == 0);
 
+	ring_handle_t rbuf = aligned_alloc(64, sizeof(ring_buf_t));
 	assert(rbuf);
+	memset(rbuf, 0, sizeof(ring_buf_t));
 
-	rbuf->buffer = buffer;
-	rbuf->capacity = size;
-	ring_buf_reset(rbuf);
+	rbuf->buffer = aligned_alloc(64, elem_size * capacity);
+	assert(rbuf->buffer);
+	rbuf->capacity = capacity;
+	rbuf->elem_size = elem_size;
+
+	pebs_stats.internal_mem_overhead += sizeof(ring_buf_t) + elem_size * capacity;
+	LOG_DEBUG("RING: size: %lu\n", sizeof(ring_buf_t) + elem_size * capacity);
 
 	assert(ring_buf_empty(rbuf));
 
@@ -63,101 +52,135 @@ ring_handle_t ring_buf_init(uint64_t** buffer, size_t size)
 void ring_buf_free(ring_handle_t rbuf)
 {
 	assert(rbuf);
+	free(rbuf->buffer);
 	free(rbuf);
 }
 
-void ring_buf_reset(ring_handle_t rbuf)
+// Copy n elements in at count pos, wrapping at the end of the buffer
+static void ring_copy_in(ring_handle_t rbuf, size_t pos, const char *data, size_t n)
 {
-    assert(rbuf);
-
-    rbuf->head = 0;
-    rbuf->tail = 0;
+	size_t idx = pos & (rbuf->capacity - 1);
+	size_t first = rbuf->capacity - idx;
+	if (first > n)
+	{
+		first = n;
+	}
+	memcpy(rbuf->buffer + idx * rbuf->elem_size, data, first * rbuf->elem_size);
+	memcpy(rbuf->buffer, data + first * rbuf->elem_size, (n - first) * rbuf->elem_size);
 }
 
-size_t ring_buf_size(ring_handle_t rbuf)
+static void ring_copy_out(ring_handle_t rbuf, size_t pos, char *data, size_t n)
 {
-	assert(rbuf);
-
-	size_t size = rbuf->capacity;
-
-	if(!ring_buf_full(rbuf))
+	size_t idx = pos & (rbuf->capacity - 1);
+	size_t first = rbuf->capacity - idx;
+	if (first > n)
 	{
-		if(rbuf->head >= rbuf->tail)
-		{
-			size = (rbuf->head - rbuf->tail);
-		}
-		else
-		{
-			size = (rbuf->capacity + rbuf->head - rbuf->tail);
-		}
-
+		first = n;
 	}
-
-	return size;
+	memcpy(data, rbuf->buffer + idx * rbuf->elem_size, first * rbuf->elem_size);
+	memcpy(data + first * rbuf->elem_size, rbuf->buffer, (n - first) * rbuf->elem_size);
 }
 
-size_t ring_buf_capacity(ring_handle_t rbuf)
+// Producer only. Puts as many of the n elements as fit, returns how many
+size_t ring_buf_put(ring_handle_t rbuf, const void *data, size_t n)
 {
-	assert(rbuf);
+	size_t head = atomic_load_explicit(&rbuf->head, memory_order_relaxed);
 
-	return rbuf->capacity;
-}
-
-void ring_buf_put(ring_handle_t rbuf, uint64_t* data)
-{
-	assert(rbuf && rbuf->buffer);
+	if (head - rbuf->tail_cache + n > rbuf->capacity)
+	{
+		rbuf->tail_cache = atomic_load_explicit(&rbuf->tail, memory_order_acquire);
+	}
+	size_t space = rbuf->capacity - (head - rbuf->tail_cache);
+	if (n > space)
+	{
+		n = space;
+	}
+	if (n == 0)
+	{
+		return 0;
+	}
 
-    rbuf->buffer[rbuf->head] = data;
+	ring_copy_in(rbuf, head, data, n);
+	atomic_store_explicit(&rbuf->head, head + n, memory_order_seq_cst);
 
-    advance_pointer(rbuf);
+	// Only pay for the syscall if the consumer is sleeping in ring_buf_wait
+	if (__atomic_load_n(&rbuf->waiters, __ATOMIC_SEQ_CST) != 0)
+	{
+		__atomic_fetch_add(&rbuf->seq, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &rbuf->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+	return n;
 }
 
-int ring_buf_put2(ring_handle_t rbuf, uint64_t* data)
+// Consumer only. Gets up to max elements, returns how many
+size_t ring_buf_get(ring_handle_t rbuf, void *data, size_t max)
 {
-    int r = -1;
+	size_t tail = atomic_load_explicit(&rbuf->tail, memory_order_relaxed);
 
-    assert(rbuf && rbuf->buffer);
-
-    if(!ring_buf_full(rbuf))
-    {
-        rbuf->buffer[rbuf->head] = data;
-        advance_pointer(rbuf);
-        r = 0;
-    }
+	if (rbuf->head_cache - tail < max)
+	{
+		rbuf->head_cache = atomic_load_explicit(&rbuf->head, memory_order_acquire);
+	}
+	size_t n = rbuf->head_cache - tail;
+	if (n > max)
+	{
+		n = max;
+	}
+	if (n == 0)
+	{
+		return 0;
+	}
 
-    return r;
+	ring_copy_out(rbuf, tail, data, n);
+	atomic_store_explicit(&rbuf->tail, tail + n, memory_order_release);
+	return n;
 }
 
-uint64_t* ring_buf_get(ring_handle_t rbuf)
+// Consumer only. Sleeps until a put or timeout_ms, returns true if it slept
+bool ring_buf_wait(ring_handle_t rbuf, int timeout_ms)
 {
-    assert(rbuf && rbuf->buffer);
-    uint64_t* cur_read;
-
-    if(!ring_buf_empty(rbuf))
-    {
-        cur_read = rbuf->buffer[rbuf->tail];
-        retreat_pointer(rbuf);
+	struct timespec timeout = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000L
+	};
+	bool slept = false;
+
+	__atomic_fetch_add(&rbuf->waiters, 1, __ATOMIC_SEQ_CST);
+	uint32_t seq = __atomic_load_n(&rbuf->seq, __ATOMIC_SEQ_CST);
+	if (ring_buf_empty(rbuf))
+	{
+		// A put that saw no waiter also published head before we checked it
+		syscall(SYS_futex, &rbuf->seq, FUTEX_WAIT_PRIVATE, seq, &timeout, NULL, 0);
+		slept = true;
+	}
+	__atomic_fetch_sub(&rbuf->waiters, 1, __ATOMIC_SEQ_CST);
+	return slept;
+}
 
-        return cur_read;
-    }
+bool ring_buf_empty(ring_handle_t rbuf)
+{
+	return ring_buf_size(rbuf) == 0;
+}
 
-    return NULL;
+bool ring_buf_full(ring_handle_t rbuf)
+{
+	return ring_buf_size(rbuf) == rbuf->capacity;
 }
 
-bool ring_buf_empty(ring_handle_t rbuf)
+size_t ring_buf_capacity(ring_handle_t rbuf)
 {
 	assert(rbuf);
 
-    return (!ring_buf_full(rbuf) && (rbuf->head == rbuf->tail));
+	return rbuf->capacity;
 }
 
-bool ring_buf_full(ring_buf_t* rbuf)
+// Exact from either side, a snapshot from anywhere else
+size_t ring_buf_size(ring_handle_t rbuf)
 {
-	size_t head = rbuf->head + 1;
-	if(head == rbuf->capacity)
-	{
-		head = 0;
-	}
+	assert(rbuf);
+
+	size_t tail = atomic_load_explicit(&rbuf->tail, memory_order_acquire);
+	size_t head = atomic_load_explicit(&rbuf->head, memory_order_seq_cst);
 
-	return head == rbuf->tail;
+	return head - tail;
 }
@@ -2,17 +2,20 @@
 #define SPSC_RING_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+// Lock-free single producer single consumer ring of fixed size elements.
+// Only one thread may put and only one thread may get at a time
 typedef struct ring_buf_t ring_buf_t;
 
 typedef ring_buf_t* ring_handle_t;
 
-ring_handle_t ring_buf_init(uint64_t** buffer, size_t size);
+ring_handle_t ring_buf_init(size_t elem_size, size_t capacity);
 void ring_buf_free(ring_handle_t rbuf);
-void ring_buf_reset(ring_handle_t rbuf);
-void ring_buf_put(ring_handle_t rbuf, uint64_t* data);
-int ring_buf_put2(ring_handle_t rbuf, uint64_t* data);
-uint64_t* ring_buf_get(ring_handle_t rbuf);
+size_t ring_buf_put(ring_handle_t rbuf, const void *data, size_t n);
+size_t ring_buf_get(ring_handle_t rbuf, void *data, size_t max);
+bool ring_buf_wait(ring_handle_t rbuf, int timeout_ms);
 bool ring_buf_empty(ring_handle_t rbuf);
 bool ring_buf_full(ring_handle_t rbuf);
 size_t ring_buf_capacity(ring_handle_t rbuf);
@@ -0,0 +1,545 @@
+#include "interpose.h"
+
+#if TMEM_MALLOC == 1
+// Malloc arenas carved from tracked memory. glibc serves everything below
+// its mmap threshold from heaps tmem only sees as a whole, so with
+// TMEM_MALLOC libtmem replaces malloc itself for allocations up to
+// TMALLOC_MAX. A TMALLOC_RESERVE range is reserved PROT_NONE at init and
+// handed out in TMALLOC_EXTENT (2MB, aligned) extents. The extent hooks
+// commit an extent with tmem_mmap, so it's placed and tracked like any
+// mapping and small objects are tiered with the extent they live in, and
+// give it back with tmem_munmap once it's been empty a while.
+//
+// Extents are split in TMALLOC_RUN runs, each holding objects of one size
+// class. Runs of a class with free objects are on the class's partial list
+// under its lock, and threads take and give back objects in batches through
+// a thread local cache, so most calls take no lock. Bigger allocations,
+// internal ones and anything before init go to libc, free tells the two
+// apart by the address.
+#define TMALLOC_EXTENT (2 * 1024UL * 1024UL)
+#define TMALLOC_RUN (256 * 1024UL)
+#define TMALLOC_RUNS (TMALLOC_EXTENT / TMALLOC_RUN)     // runs per extent
+#define TMALLOC_CLASSES 48      // 16 to 128 in steps of 16, then four per doubling up to 128KB
+#define TMALLOC_BATCH 32        // most objects a thread cache takes at once
+#define TMALLOC_BOOTSTRAP (64 * 1024)
+
+_Static_assert(TMALLOC_MAX <= 128 * 1024UL, "TMALLOC_MAX is past the last size class");
+
+struct tmalloc_run {
+    struct tmalloc_run *next, *prev;    // class's partial runs, under its lock
+    void *free;                         // freed objects, linked through their first word
+    uint32_t bump;                      // objects from here on were never handed out
+    uint32_t nfree;
+    int32_t cls;                        // -1 while the run is free
+};
+
+enum { EXTENT_UNUSED, EXTENT_CACHED, EXTENT_AVAIL, EXTENT_FULL };
+
+struct tmalloc_extent {
+    struct tmalloc_extent *next, *prev;     // avail list, or the cached and decommitted stacks
+    uint32_t free_runs;
+    uint8_t state;
+};
+
+struct tmalloc_class {
+    pthread_mutex_t lock;
+    struct tmalloc_run *partial;
+} __attribute__((aligned(64)));
+
+struct tcache_bin {
+    void *head;
+    uint32_t n;
+};
+
+static struct {
+    bool ready;
+    pid_t pid;
+    uint64_t base, end;
+    struct tmalloc_run *runs;
+    struct tmalloc_extent *extents;
+    struct tmalloc_class classes[TMALLOC_CLASSES];
+    pthread_key_t key;
+
+    // Under extent_lock
+    pthread_mutex_t extent_lock;
+    struct tmalloc_extent *avail;           // committed, some runs free
+    struct tmalloc_extent *cached;          // committed, all runs free
+    struct tmalloc_extent *decommitted;     // given back, reserved again
+    uint64_t num_cached;
+    uint64_t next_extent;                   // extents past this were never used
+} tmalloc = { .extent_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static _Thread_local struct tcache_bin tcache[TMALLOC_CLASSES];
+static _Thread_local bool tcache_registered = false;
+static _Thread_local bool tcache_dead = false;   // thread is exiting, frees skip the cache
+
+// libc's allocator for what isn't ours. dlsym can allocate itself, that is
+// served from a static buffer and never freed
+static void* (*libc_calloc)(size_t nmemb, size_t size) = NULL;
+static void* (*libc_realloc)(void *ptr, size_t size) = NULL;
+static void* (*libc_memalign)(size_t alignment, size_t size) = NULL;
+static size_t (*libc_usable_size)(void *ptr) = NULL;
+static _Thread_local bool resolving = false;
+
+static char bootstrap[TMALLOC_BOOTSTRAP] __attribute__((aligned(64)));
+static uint64_t bootstrap_used = 0;
+
+static void* bootstrap_alloc(size_t alignment, size_t size) {
+    // The size sits in the 16 bytes before the object
+    uint64_t off = __atomic_load_n(&bootstrap_used, __ATOMIC_RELAXED);
+    uint64_t start, next;
+    do {
+        start = (off + 16 + alignment - 1) & ~(alignment - 1);
+        next = start + size;
+        if (next > TMALLOC_BOOTSTRAP) return NULL;
+    } while (!__atomic_compare_exchange_n(&bootstrap_used, &off, next, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *(uint64_t *)(bootstrap + start - 16) = size;
+    return bootstrap + start;
+}
+
+static inline bool in_bootstrap(void *ptr) {
+    return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + TMALLOC_BOOTSTRAP;
+}
+
+static void libc_resolve(void) {
+    if (libc_memalign != NULL || resolving) return;
+    resolving = true;
+    libc_malloc = dlsym(RTLD_NEXT, "malloc");
+    libc_free = dlsym(RTLD_NEXT, "free");
+    libc_calloc = dlsym(RTLD_NEXT, "calloc");
+    libc_realloc = dlsym(RTLD_NEXT, "realloc");
+    libc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+    __atomic_store_n(&libc_memalign, dlsym(RTLD_NEXT, "memalign"), __ATOMIC_RELEASE);
+    resolving = false;
+}
+
+static inline bool tmalloc_owns(void *ptr) {
+    return (uint64_t)ptr - tmalloc.base < tmalloc.end - tmalloc.base;
+}
+
+static inline bool tmalloc_usable(void) {
+    return __atomic_load_n(&tmalloc.ready, __ATOMIC_ACQUIRE) && !internal_call;
+}
+
+static inline int size_class(size_t size) {
+    if (size <= 128) return size == 0 ? 0 : (size - 1) / 16;
+    int lg = 63 - __builtin_clzl(size - 1);
+    return 8 + (lg - 7) * 4 + (((size - 1) >> (lg - 2)) & 3);
+}
+
+static inline size_t class_size(int cls) {
+    if (cls < 8) return (cls + 1) * 16;
+    int lg = 7 + (cls - 8) / 4;
+    return (1UL << lg) + ((cls - 8) % 4 + 1) * (1UL << (lg - 2));
+}
+
+// Objects a thread cache takes at once, about an eighth of a run
+static inline uint32_t class_batch(int cls) {
+    uint64_t n = TMALLOC_RUN / 8 / class_size(cls);
+    return n == 0 ? 1 : n > TMALLOC_BATCH ? TMALLOC_BATCH : n;
+}
+
+static inline struct tmalloc_run* run_of(void *ptr) {
+    return &tmalloc.runs[((uint64_t)ptr - tmalloc.base) / TMALLOC_RUN];
+}
+
+static inline uint64_t run_addr(struct tmalloc_run *run) {
+    return tmalloc.base + (run - tmalloc.runs) * TMALLOC_RUN;
+}
+
+static inline uint64_t extent_addr(struct tmalloc_extent *extent) {
+    return tmalloc.base + (extent - tmalloc.extents) * TMALLOC_EXTENT;
+}
+
+// Extent hooks. Committing maps the extent through tmem_mmap so it's placed
+// and tracked, giving it back untracks it and reserves it again. A forked
+// child has no tmem threads and may have inherited its locks held, it maps
+// the memory plainly
+static bool extent_commit(struct tmalloc_extent *extent) {
+    void *addr = (void *)extent_addr(extent);
+    if (getpid() != tmalloc.pid) {
+        internal_call = true;
+        void *p = libc_mmap(addr, TMALLOC_EXTENT, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        internal_call = false;
+        return p != MAP_FAILED;
+    }
+    tmem_mmap(addr, TMALLOC_EXTENT, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    STAT_INC(pebs_stats.malloc_extent_allocs);
+    // Whatever the log allocates comes from libc, the caller holds arena locks
+    internal_call = true;
+    LOG_DEBUG("TMALLOC: committed extent %p\n", addr);
+    internal_call = false;
+    return true;
+}
+
+static void extent_decommit(struct tmalloc_extent *extent) {
+    void *addr = (void *)extent_addr(extent);
+    if (getpid() == tmalloc.pid) {
+        tmem_munmap(addr, TMALLOC_EXTENT);
+        STAT_INC(pebs_stats.malloc_extent_frees);
+    }
+    internal_call = true;
+    LOG_DEBUG("TMALLOC: gave back extent %p\n", addr);
+    if (libc_mmap(addr, TMALLOC_EXTENT, PROT_NONE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+        perror("tmalloc mmap");
+    }
+    internal_call = false;
+}
+
+static inline void extent_push(struct tmalloc_extent **list, struct tmalloc_extent *extent) {
+    extent->prev = NULL;
+    extent->next = *list;
+    if (*list != NULL) (*list)->prev = extent;
+    *list = extent;
+}
+
+static inline void extent_unlink(struct tmalloc_extent **list, struct tmalloc_extent *extent) {
+    if (extent->prev != NULL) extent->prev->next = extent->next;
+    else *list = extent->next;
+    if (extent->next != NULL) extent->next->prev = extent->prev;
+}
+
+// An extent with a free run, committing one if needed. Call with
+// extent_lock held
+static struct tmalloc_extent* extent_get(void) {
+    struct tmalloc_extent *extent = tmalloc.avail;
+    if (extent != NULL) return extent;
+
+    if (tmalloc.cached != NULL) {
+        extent = tmalloc.cached;
+        extent_unlink(&tmalloc.cached, extent);
+        tmalloc.num_cached--;
+    } else {
+        if (tmalloc.decommitted != NULL) {
+            extent = tmalloc.decommitted;
+            extent_unlink(&tmalloc.decommitted, extent);
+        } else if (tmalloc.base + (tmalloc.next_extent + 1) * TMALLOC_EXTENT <= tmalloc.end) {
+            extent = &tmalloc.extents[tmalloc.next_extent++];
+        } else {
+            return NULL;
+        }
+        if (!extent_commit(extent)) {
+            extent_push(&tmalloc.decommitted, extent);
+            return NULL;
+        }
+        extent->free_runs = TMALLOC_RUNS;
+        for (uint64_t i = 0; i < TMALLOC_RUNS; i++) {
+            tmalloc.runs[(extent - tmalloc.extents) * TMALLOC_RUNS + i].cls = -1;
+        }
+    }
+    extent->state = EXTENT_AVAIL;
+    extent_push(&tmalloc.avail, extent);
+    return extent;
+}
+
+// A fresh run for the class. Call with the class lock held
+static struct tmalloc_run* run_new(int cls) {
+    pthread_mutex_lock(&tmalloc.extent_lock);
+    struct tmalloc_extent *extent = extent_get();
+    if (extent == NULL) {
+        pthread_mutex_unlock(&tmalloc.extent_lock);
+        return NULL;
+    }
+    struct tmalloc_run *run = &tmalloc.runs[(extent - tmalloc.extents) * TMALLOC_RUNS];
+    while (run->cls != -1) run++;
+    run->cls = cls;
+    if (--extent->free_runs == 0) {
+        extent_unlink(&tmalloc.avail, extent);
+        extent->state = EXTENT_FULL;
+    }
+    pthread_mutex_unlock(&tmalloc.extent_lock);
+
+    run->free = NULL;
+    run->bump = 0;
+    run->nfree = TMALLOC_RUN / class_size(cls);
+    return run;
+}
+
+// Gives an empty run back to its extent. Call with the class lock held
+static void run_release(struct tmalloc_run *run) {
+    struct tmalloc_extent *extent = &tmalloc.extents[(run - tmalloc.runs) / TMALLOC_RUNS];
+    pthread_mutex_lock(&tmalloc.extent_lock);
+    run->cls = -1;
+    if (extent->state == EXTENT_FULL) {
+        extent->state = EXTENT_AVAIL;
+        extent_push(&tmalloc.avail, extent);
+    }
+    if (++extent->free_runs == TMALLOC_RUNS) {
+        extent_unlink(&tmalloc.avail, extent);
+        if (tmalloc.num_cached < TMALLOC_EXTENT_CACHE) {
+            extent->state = EXTENT_CACHED;
+            extent_push(&tmalloc.cached, extent);
+            tmalloc.num_cached++;
+        } else {
+            extent->state = EXTENT_UNUSED;
+            extent_decommit(extent);
+            extent_push(&tmalloc.decommitted, extent);
+        }
+    }
+    pthread_mutex_unlock(&tmalloc.extent_lock);
+}
+
+static inline void run_link(struct tmalloc_class *class, struct tmalloc_run *run) {
+    run->prev = NULL;
+    run->next = class->partial;
+    if (class->partial != NULL) class->partial->prev = run;
+    class->partial = run;
+}
+
+static inline void run_unlink(struct tmalloc_class *class, struct tmalloc_run *run) {
+    if (run->prev != NULL) run->prev->next = run->next;
+    else class->partial = run->next;
+    if (run->next != NULL) run->next->prev = run->prev;
+}
+
+// Call with the class lock held
+static void* run_alloc(int cls) {
+    struct tmalloc_class *class = &tmalloc.classes[cls];
+    struct tmalloc_run *run = class->partial;
+    if (run == NULL) {
+        run = run_new(cls);
+        if (run == NULL) return NULL;
+        run_link(class, run);
+    }
+
+    void *ptr = run->free;
+    if (ptr != NULL) run->free = *(void **)ptr;
+    else ptr = (void *)(run_addr(run) + run->bump++ * class_size(cls));
+    if (--run->nfree == 0) run_unlink(class, run);
+    return ptr;
+}
+
+// Call with the class lock held
+static void run_free(int cls, void *ptr) {
+    struct tmalloc_class *class = &tmalloc.classes[cls];
+    struct tmalloc_run *run = run_of(ptr);
+    *(void **)ptr = run->free;
+    run->free = ptr;
+    if (run->nfree++ == 0) run_link(class, run);
+
+    // An empty run is kept while it's the class's only partial one
+    if (run->nfree == TMALLOC_RUN / class_size(cls) && (run->prev != NULL || run->next != NULL)) {
+        run_unlink(class, run);
+        run_release(run);
+    }
+}
+
+static void tcache_flush(int cls, uint32_t n) {
+    struct tcache_bin *bin = &tcache[cls];
+    pthread_mutex_lock(&tmalloc.classes[cls].lock);
+    while (n-- > 0 && bin->head != NULL) {
+        void *ptr = bin->head;
+        bin->head = *(void **)ptr;
+        bin->n--;
+        run_free(cls, ptr);
+    }
+    pthread_mutex_unlock(&tmalloc.classes[cls].lock);
+}
+
+// pthread key destructor, the exiting thread's objects go back to their runs
+static void tcache_exit(void *arg) {
+    tcache_dead = true;
+    for (int cls = 0; cls < TMALLOC_CLASSES; cls++) {
+        if (tcache[cls].n != 0) tcache_flush(cls, tcache[cls].n);
+    }
+}
+
+static void* tmalloc_alloc(int cls) {
+    struct tcache_bin *bin = &tcache[cls];
+    if (bin->head == NULL) {
+        if (!tcache_registered && !tcache_dead) {
+            pthread_setspecific(tmalloc.key, (void *)1);
+            tcache_registered = true;
+        }
+        uint32_t batch = tcache_dead ? 1 : class_batch(cls);
+        pthread_mutex_lock(&tmalloc.classes[cls].lock);
+        while (bin->n < batch) {
+            void *ptr = run_alloc(cls);
+            if (ptr == NULL) break;
+            *(void **)ptr = bin->head;
+            bin->head = ptr;
+            bin->n++;
+        }
+        pthread_mutex_unlock(&tmalloc.classes[cls].lock);
+        if (bin->head == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    void *ptr = bin->head;
+    bin->head = *(void **)ptr;
+    bin->n--;
+    return ptr;
+}
+
+static void tmalloc_free(void *ptr) {
+    int cls = run_of(ptr)->cls;
+    struct tcache_bin *bin = &tcache[cls];
+    *(void **)ptr = bin->head;
+    bin->head = ptr;
+    bin->n++;
+    if (tcache_dead) tcache_flush(cls, bin->n);
+    else if (bin->n > 2 * class_batch(cls)) tcache_flush(cls, class_batch(cls));
+}
+
+static void tmalloc_prefork(void) {
+    for (int cls = 0; cls < TMALLOC_CLASSES; cls++) pthread_mutex_lock(&tmalloc.classes[cls].lock);
+    pthread_mutex_lock(&tmalloc.extent_lock);
+}
+
+static void tmalloc_postfork(void) {
+    pthread_mutex_unlock(&tmalloc.extent_lock);
+    for (int cls = TMALLOC_CLASSES - 1; cls >= 0; cls--) pthread_mutex_unlock(&tmalloc.classes[cls].lock);
+}
+
+// Called from the constructor with internal_call set, after tmem_init
+void tmalloc_init(void) {
+    libc_resolve();
+
+    // An extent more so an aligned range fits, the slack stays reserved
+    char *p = libc_mmap(NULL, TMALLOC_RESERVE + TMALLOC_EXTENT, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("tmalloc reserve");
+        return;
+    }
+    tmalloc.base = ((uint64_t)p + TMALLOC_EXTENT - 1) & ~(TMALLOC_EXTENT - 1);
+    tmalloc.end = tmalloc.base + TMALLOC_RESERVE;
+
+    // Only touched as extents get used
+    uint64_t num_extents = TMALLOC_RESERVE / TMALLOC_EXTENT;
+    size_t meta = num_extents * (sizeof(struct tmalloc_extent) + TMALLOC_RUNS * sizeof(struct tmalloc_run));
+    char *m = libc_mmap(NULL, meta, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m == MAP_FAILED) {
+        perror("tmalloc metadata");
+        return;
+    }
+    tmalloc.runs = (struct tmalloc_run *)m;
+    tmalloc.extents = (struct tmalloc_extent *)(m + num_extents * TMALLOC_RUNS * sizeof(struct tmalloc_run));
+    pebs_stats.internal_mem_overhead += meta;
+
+    for (int cls = 0; cls < TMALLOC_CLASSES; cls++) {
+        pthread_mutex_init(&tmalloc.classes[cls].lock, NULL);
+        tmalloc.classes[cls].partial = NULL;
+    }
+    pthread_key_create(&tmalloc.key, tcache_exit);
+    pthread_atfork(tmalloc_prefork, tmalloc_postfork, tmalloc_postfork);
+    tmalloc.pid = getpid();
+    __atomic_store_n(&tmalloc.ready, true, __ATOMIC_RELEASE);
+    LOG_DEBUG("TMALLOC: arenas at 0x%lx - 0x%lx\n", tmalloc.base, tmalloc.end);
+}
+
+static void* tmalloc_memalign(size_t alignment, size_t size) {
+    if (tmalloc_usable() && alignment <= TMALLOC_MAX && size <= TMALLOC_MAX) {
+        // Runs are aligned, so a class whose size is a multiple of the
+        // alignment keeps every object aligned
+        size_t want = size > alignment ? size : alignment;
+        for (int cls = size_class(want); cls < TMALLOC_CLASSES; cls++) {
+            if (class_size(cls) % alignment == 0) return tmalloc_alloc(cls);
+        }
+    }
+    libc_resolve();
+    if (__atomic_load_n(&libc_memalign, __ATOMIC_ACQUIRE) == NULL) return bootstrap_alloc(alignment, size);
+    return libc_memalign(alignment, size);
+}
+
+void* malloc(size_t size) {
+    if (tmalloc_usable() && size <= TMALLOC_MAX) return tmalloc_alloc(size_class(size));
+    libc_resolve();
+    if (__atomic_load_n(&libc_memalign, __ATOMIC_ACQUIRE) == NULL) return bootstrap_alloc(16, size);
+    return libc_malloc(size);
+}
+
+void free(void *ptr) {
+    if (ptr == NULL || in_bootstrap(ptr)) return;
+    if (tmalloc_owns(ptr)) {
+        tmalloc_free(ptr);
+        return;
+    }
+    libc_resolve();
+    libc_free(ptr);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (tmalloc_usable() && total <= TMALLOC_MAX) {
+        void *ptr = tmalloc_alloc(size_class(total));
+        if (ptr != NULL) memset(ptr, 0, total);
+        return ptr;
+    }
+    libc_resolve();
+    // The static buffer is zeroed and never reused
+    if (__atomic_load_n(&libc_memalign, __ATOMIC_ACQUIRE) == NULL) return bootstrap_alloc(16, total);
+    return libc_calloc(nmemb, size);
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL) return 0;
+    if (in_bootstrap(ptr)) return *(uint64_t *)((char *)ptr - 16);
+    if (tmalloc_owns(ptr)) return class_size(run_of(ptr)->cls);
+    libc_resolve();
+    return libc_usable_size(ptr);
+}
+
+void* realloc(void *ptr, size_t size) {
+    if (ptr == NULL) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (!tmalloc_owns(ptr) && !in_bootstrap(ptr)) {
+        libc_resolve();
+        return libc_realloc(ptr, size);
+    }
+
+    size_t old_size = malloc_usable_size(ptr);
+    // Stays put unless it shrinks to less than half
+    if (tmalloc_owns(ptr) && size <= old_size && size > old_size / 2) return ptr;
+    void *p = malloc(size);
+    if (p == NULL) return NULL;
+    memcpy(p, ptr, size < old_size ? size : old_size);
+    free(ptr);
+    return p;
+}
+
+void* reallocarray(void *ptr, size_t nmemb, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    if (alignment <= 16) return malloc(size);
+    if (alignment & (alignment - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return tmalloc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1))) return EINVAL;
+    void *p = memalign(alignment, size);
+    if (p == NULL) return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void* valloc(size_t size) {
+    return memalign(BASE_PAGE_SIZE, size);
+}
+
+void* pvalloc(size_t size) {
+    return memalign(BASE_PAGE_SIZE, (size + BASE_PAGE_SIZE - 1) & BASE_PAGE_MASK);
+}
+#endif
@@ -1,6 +1,5 @@
 #include "tmem.h"
 
-struct tmem_page *pages = NULL;
 struct fifo_list hot_list;
 struct fifo_list cold_list;
 struct fifo_list free_list;
@@ -17,44 +16,134 @@ static uint64_t min_tmem_va = UINT64_MAX;
 
 _Atomic bool dram_lock = false;
 
+#define PAGE_ROUND_UP(x) (((x) + (PAGE_SIZE)-1) & (~((PAGE_SIZE)-1)))
+#define PAGE_ROUND_DOWN(x) ((x) & (~((PAGE_SIZE)-1)))
+
+#define PAGE_ROUND_UP_BASE(x) (((x) + (BASE_PAGE_SIZE)-1) & (~((BASE_PAGE_SIZE)-1)))
+
+// Page index: a three level radix table over va_start >> PAGE_SHIFT. Each
+// leaf slot chains the pages that start in that PAGE_SIZE window, and since
+// no page is bigger than PAGE_SIZE the page covering an address starts in
+// its window or the one before. Lookups take no lock and must run inside an
+// epoch section, add/remove hold pages_lock. Nodes are never freed, removed
+// pages are retired through the epoch before they can be recycled under a
+// reader
+#define INDEX_BITS (48 - PAGE_SHIFT)
+#define INDEX_LEVEL_BITS ((INDEX_BITS + 2) / 3)
+#define INDEX_FANOUT (1UL << INDEX_LEVEL_BITS)
+#define INDEX_MASK (INDEX_FANOUT - 1)
+#define INDEX_LEAF_SPAN (PAGE_SIZE << INDEX_LEVEL_BITS)    // addresses one leaf covers
+
+struct index_leaf {
+    struct tmem_page *slots[INDEX_FANOUT];
+};
+
+struct index_mid {
+    struct index_leaf *leaves[INDEX_FANOUT];
+};
+
+static struct index_mid *index_root[INDEX_FANOUT];
+
+static struct tmem_page** index_slot(uint64_t va, bool create) {
+    uint64_t key = va >> PAGE_SHIFT;
+    if (key >> (3 * INDEX_LEVEL_BITS)) return NULL;
+
+    struct index_mid **midp = &index_root[key >> (2 * INDEX_LEVEL_BITS)];
+    struct index_mid *mid = __atomic_load_n(midp, __ATOMIC_ACQUIRE);
+    if (mid == NULL) {
+        if (!create) return NULL;
+        mid = libc_mmap(NULL, sizeof(struct index_mid), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        assert(mid != MAP_FAILED);
+        pebs_stats.internal_mem_overhead += sizeof(struct index_mid);
+        __atomic_store_n(midp, mid, __ATOMIC_RELEASE);
+    }
+
+    struct index_leaf **leafp = &mid->leaves[(key >> INDEX_LEVEL_BITS) & INDEX_MASK];
+    struct index_leaf *leaf = __atomic_load_n(leafp, __ATOMIC_ACQUIRE);
+    if (leaf == NULL) {
+        if (!create) return NULL;
+        leaf = libc_mmap(NULL, sizeof(struct index_leaf), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        assert(leaf != MAP_FAILED);
+        pebs_stats.internal_mem_overhead += sizeof(struct index_leaf);
+        __atomic_store_n(leafp, leaf, __ATOMIC_RELEASE);
+    }
+    return &leaf->slots[key & INDEX_MASK];
+}
+
 // If the allocations are smaller than the PAGE_SIZE it's possible to 
 void add_page(struct tmem_page *page) {
     struct tmem_page *p;
     pthread_mutex_lock(&pages_lock);
 
-    // struct tmem_page *cur_page, *tmp;
-    // LOG_DEBUG("pages: ");
-    // HASH_ITER(hh, pages, cur_page, tmp) {
-    //     LOG_DEBUG("0x%lx, ", cur_page->va);
-    // }
-    // LOG_DEBUG("\n");
-
-    HASH_FIND(hh, pages, &(page->va), sizeof(uint64_t), p);
-    if (p != NULL) {
-        LOG_DEBUG("add_page: duplicate page: 0x%lx\n", page->va);
-        // free(page);
-        pthread_mutex_unlock(&pages_lock);
-        return;
+    assert(page->size <= PAGE_SIZE);
+    struct tmem_page **slot = index_slot((uint64_t)page->va_start, true);
+    assert(slot != NULL);
+    for (p = *slot; p != NULL; p = p->index_next) {
+        if (p->va_start == page->va_start) {
+            LOG_DEBUG("add_page: duplicate page: 0x%lx\n", page->va);
+            pthread_mutex_unlock(&pages_lock);
+            return;
+        }
     }
-    assert(p == NULL);
-    HASH_ADD(hh, pages, va, sizeof(uint64_t), page);
+    // Publish the page only once its next pointer is set
+    page->index_next = *slot;
+    __atomic_store_n(slot, page, __ATOMIC_RELEASE);
     pthread_mutex_unlock(&pages_lock);
 }
 
-void remove_page(struct tmem_page *page)
-{
-  pthread_mutex_lock(&pages_lock);
-  HASH_DEL(pages, page);
-  pthread_mutex_unlock(&pages_lock);
-}
+// Unlinks up to max pages overlapping [*next, end) into buf, holding
+// pages_lock once for all of them. *next moves past the windows done, a
+// page starting in the window before *next is checked too. Windows of
+// missing leaves are skipped a leaf at a time
+static size_t remove_pages(uint64_t *next, uint64_t end, struct tmem_page **buf, size_t max) {
+    uint64_t start = *next;
+    uint64_t va = PAGE_ROUND_DOWN(start);
+    if (va >= PAGE_SIZE) va -= PAGE_SIZE;
+    size_t n = 0;
 
-struct tmem_page* find_page_no_lock(uint64_t va) {
-    struct tmem_page *page;
-    if (pthread_mutex_trylock(&pages_lock) != 0) {
-        return NULL;    // Abort early so no waiting
+    pthread_mutex_lock(&pages_lock);
+    while (va < end) {
+        struct tmem_page **pp = index_slot(va, false);
+        if (pp == NULL) {
+            va = (va & ~(INDEX_LEAF_SPAN - 1)) + INDEX_LEAF_SPAN;
+            continue;
+        }
+        while (*pp != NULL) {
+            struct tmem_page *page = *pp;
+            uint64_t page_start = (uint64_t)page->va_start;
+            if (page_start >= end || page_start + page->size <= start) {
+                pp = &page->index_next;
+                continue;
+            }
+            if (n == max) break;
+            // Readers on the page go on through its index_next
+            __atomic_store_n(pp, page->index_next, __ATOMIC_RELEASE);
+            buf[n++] = page;
+        }
+        if (n == max) break;
+        va += PAGE_SIZE;
     }
-    HASH_FIND(hh, pages, &va, sizeof(uint64_t), page);
     pthread_mutex_unlock(&pages_lock);
+
+    *next = va > start ? va : start;
+    return n;
+}
+
+static struct tmem_page* index_find(uint64_t key_va, uint64_t va) {
+    struct tmem_page **slot = index_slot(key_va, false);
+    if (slot == NULL) return NULL;
+    struct tmem_page *page = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    while (page != NULL && (va < (uint64_t)page->va_start || va >= (uint64_t)page->va_start + page->size)) {
+        page = __atomic_load_n(&page->index_next, __ATOMIC_ACQUIRE);
+    }
+    return page;
+}
+
+// Returns the page covering va, which can be any address inside it.
+// Lock-free, call inside epoch_enter()/epoch_exit()
+struct tmem_page* find_page_no_lock(uint64_t va) {
+    struct tmem_page *page = index_find(va, va);
+    if (page == NULL && va >= PAGE_SIZE) page = index_find(va - PAGE_SIZE, va);
     return page;
 }
 
@@ -62,11 +151,625 @@ struct tmem_page* find_page(uint64_t va)
 {
   struct tmem_page *page;
   pthread_mutex_lock(&pages_lock);
-  HASH_FIND(hh, pages, &va, sizeof(uint64_t), page);
+  page = find_page_no_lock(va);
   pthread_mutex_unlock(&pages_lock);
   return page;
 }
 
+// Calls fn on every page overlapping [start, end). Lock-free, call inside
+// epoch_enter()/epoch_exit(). Pages added or removed meanwhile may or may
+// not be seen
+static void walk_pages(uint64_t start, uint64_t end, void (*fn)(struct tmem_page *page, void *arg), void *arg) {
+    uint64_t va = PAGE_ROUND_DOWN(start);
+    if (va >= PAGE_SIZE) va -= PAGE_SIZE;
+    while (va < end) {
+        struct tmem_page **slot = index_slot(va, false);
+        if (slot == NULL) {
+            va = (va & ~(INDEX_LEAF_SPAN - 1)) + INDEX_LEAF_SPAN;
+            continue;
+        }
+        struct tmem_page *page = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        for (; page != NULL; page = __atomic_load_n(&page->index_next, __ATOMIC_ACQUIRE)) {
+            uint64_t page_start = (uint64_t)page->va_start;
+            if (page_start < end && page_start + page->size > start) fn(page, arg);
+        }
+        va += PAGE_SIZE;
+    }
+}
+
+// Copies the start addresses of up to max tracked pages into buf. Returns
+// the number of tracked pages, which is more than max if buf was too small.
+// Pages can be freed once the caller leaves the epoch, so it keeps
+// addresses and looks them up again
+size_t snapshot_pages(uint64_t *buf, size_t max) {
+    size_t n = 0;
+    pthread_mutex_lock(&pages_lock);
+    for (uint64_t i = 0; i < INDEX_FANOUT; i++) {
+        struct index_mid *mid = index_root[i];
+        if (mid == NULL) continue;
+        for (uint64_t j = 0; j < INDEX_FANOUT; j++) {
+            struct index_leaf *leaf = mid->leaves[j];
+            if (leaf == NULL) continue;
+            for (uint64_t k = 0; k < INDEX_FANOUT; k++) {
+                for (struct tmem_page *page = leaf->slots[k]; page != NULL; page = page->index_next) {
+                    if (n < max) buf[n] = (uint64_t)page->va_start;
+                    n++;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&pages_lock);
+    return n;
+}
+
+// Page metadata slabs. Each TMEM_SLAB_SIZE slab holds SLAB_PAGES pages
+// after its header, hot halves at the front and cold halves at the back, so
+// the metadata of pages mapped together stays in dense arrays. Slabs prefer
+// the DRAM node and are aligned to their size, so a page finds its slab by
+// masking its address. Threads take TMEM_SLAB_BATCH entries at a time into
+// a thread local run, so an mmap rarely takes slab_lock and only maps when
+// a slab runs out. Freed pages are recycled through free_list, and once
+// that holds more than TMEM_FREE_HIGH pages slab_trim gives back slabs
+// whose entries are all on it
+struct tmem_slab {
+    struct tmem_slab *next, *prev;  // every slab, under slab_lock
+    uint64_t handed;                // entries slab_alloc_page gave out
+    uint64_t freed;                 // of those, how many are on free_list
+} __attribute__((aligned(64)));
+
+#define SLAB_PAGES ((TMEM_SLAB_SIZE - sizeof(struct tmem_slab)) / (sizeof(struct tmem_page) + sizeof(struct tmem_page_cold)))
+#define SLAB_OF(page) ((struct tmem_slab *)((uint64_t)(page) & ~(TMEM_SLAB_SIZE - 1)))
+
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tmem_slab *slabs = NULL;
+static struct tmem_page *slab_hot = NULL;
+static struct tmem_page_cold *slab_cold = NULL;
+static uint64_t slab_used = SLAB_PAGES;     // entries handed out of the current slab
+
+static _Thread_local struct tmem_page *run_hot = NULL;
+static _Thread_local struct tmem_page_cold *run_cold = NULL;
+static _Thread_local uint64_t run_left = 0;
+// An exiting thread hands what's left of its run to free_list, else the
+// slab's handed count never gets to SLAB_PAGES and slab_trim keeps it
+static pthread_once_t run_once = PTHREAD_ONCE_INIT;
+static pthread_key_t run_key;
+static _Thread_local bool run_registered = false;
+
+static inline struct tmem_page* slab_page(struct tmem_slab *slab, uint64_t i) {
+    return (struct tmem_page *)(slab + 1) + i;
+}
+
+static void* slab_map(void) {
+    // Twice the size so an aligned slab fits, the rest is given back
+    char *p = libc_mmap(NULL, 2 * TMEM_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(p != MAP_FAILED);
+    char *slab = (char *)(((uint64_t)p + TMEM_SLAB_SIZE - 1) & ~(TMEM_SLAB_SIZE - 1));
+    if (slab != p) libc_munmap(p, slab - p);
+    if (slab + TMEM_SLAB_SIZE != p + 2 * TMEM_SLAB_SIZE) libc_munmap(slab + TMEM_SLAB_SIZE, p + TMEM_SLAB_SIZE - slab);
+    return slab;
+}
+
+static void run_exit(void *arg);
+
+static void run_key_create(void) {
+    int s = pthread_key_create(&run_key, run_exit);
+    assert(s == 0);
+}
+
+static void slab_refill(void) {
+    if (!run_registered) {
+        pthread_once(&run_once, run_key_create);
+        pthread_setspecific(run_key, (void *)1);
+        run_registered = true;
+    }
+    pthread_mutex_lock(&slab_lock);
+    if (slab_used == SLAB_PAGES) {
+        struct tmem_slab *slab = slab_map();
+        // Preferred rather than bound so metadata still gets memory once DRAM is full
+        unsigned long dram_nodemask = 1UL << DRAM_NODE;
+        if (mbind(slab, TMEM_SLAB_SIZE, MPOL_PREFERRED, &dram_nodemask, 64, 0) == -1) {
+            perror("mbind");
+        }
+        pebs_stats.internal_mem_overhead += TMEM_SLAB_SIZE;
+        LOG_DEBUG("SLAB: new slab of %lu pages\n", SLAB_PAGES);
+
+        slab->next = slabs;
+        if (slabs != NULL) slabs->prev = slab;
+        slabs = slab;
+        slab_hot = slab_page(slab, 0);
+        slab_cold = (struct tmem_page_cold *)(slab_hot + SLAB_PAGES);
+        slab_used = 0;
+    }
+    uint64_t n = SLAB_PAGES - slab_used;
+    if (n > TMEM_SLAB_BATCH) n = TMEM_SLAB_BATCH;
+    run_hot = slab_hot + slab_used;
+    run_cold = slab_cold + slab_used;
+    run_left = n;
+    slab_used += n;
+    pthread_mutex_unlock(&slab_lock);
+}
+
+// Zeroed page with its cold half attached
+static struct tmem_page* slab_alloc_page(void) {
+    if (run_left == 0) slab_refill();
+    struct tmem_page *page = run_hot++;
+    page->cold = run_cold++;
+    page->cold->page = page;
+    run_left--;
+    // After the cold half is attached, slab_trim goes by this
+    __atomic_fetch_add(&SLAB_OF(page)->handed, 1, __ATOMIC_RELEASE);
+    return page;
+}
+
+// Grace period over, nothing can still be looking at the page
+static void recycle_page(struct epoch_entry *entry) {
+    struct tmem_page_cold *cold = (struct tmem_page_cold *)((char *)entry - offsetof(struct tmem_page_cold, retire));
+    enqueue_fifo(&free_list, cold->page);
+    __atomic_fetch_add(&SLAB_OF(cold->page)->freed, 1, __ATOMIC_RELEASE);
+}
+
+// Thread exit, the rest of the run goes on free_list like freed pages. A
+// later refill by another destructor registers the thread again
+static void run_exit(void *arg) {
+    run_registered = false;
+    while (run_left > 0) {
+        struct tmem_page *page = slab_alloc_page();
+        atomic_store_explicit(&page->state, PAGE_FREE, memory_order_release);
+        recycle_page(&page->cold->retire);
+    }
+}
+
+#if CLUSTER_ALGO == 0
+// Unmaps slabs whose entries are all on free_list until it's down to half
+// of TMEM_FREE_HIGH. Everything on free_list is past its grace period, so
+// only free_list itself still points at them. The counts only pick the
+// candidates, an entry some mmap dequeued meanwhile isn't on free_list any
+// more and the slab is put back
+static void slab_trim(void) {
+    pthread_mutex_lock(&slab_lock);
+    struct tmem_slab *slab = slabs;
+    while (slab != NULL && __atomic_load_n(&free_list.numentries, __ATOMIC_ACQUIRE) > TMEM_FREE_HIGH / 2) {
+        struct tmem_slab *next = slab->next;
+        if (__atomic_load_n(&slab->handed, __ATOMIC_ACQUIRE) != SLAB_PAGES
+            || __atomic_load_n(&slab->freed, __ATOMIC_ACQUIRE) != SLAB_PAGES) {
+            slab = next;
+            continue;
+        }
+
+        uint64_t i;
+        for (i = 0; i < SLAB_PAGES; i++) {
+            if (!page_list_remove_page(&free_list, slab_page(slab, i))) break;
+        }
+        if (i < SLAB_PAGES) {
+            while (i-- > 0) enqueue_fifo(&free_list, slab_page(slab, i));
+            slab = next;
+            continue;
+        }
+
+        if (slab->prev != NULL) slab->prev->next = slab->next;
+        else slabs = slab->next;
+        if (slab->next != NULL) slab->next->prev = slab->prev;
+        libc_munmap(slab, TMEM_SLAB_SIZE);
+        pebs_stats.internal_mem_overhead -= TMEM_SLAB_SIZE;
+        LOG_DEBUG("SLAB: gave back a slab, %lu pages left on the free list\n", free_list.numentries);
+        slab = next;
+    }
+    pthread_mutex_unlock(&slab_lock);
+}
+#endif
+
+// Makes a fresh or recycled page live in the given generation and puts it
+// on the cold list if it's in DRAM. Held busy until then so the migrate
+// thread can't dequeue it before its list bits say where it is. With
+// TMEM_FINE the caller set up its base pages first
+static void page_publish(struct tmem_page *page, uint32_t gen, bool rem) {
+    uint32_t state = gen | (rem ? PAGE_REM : 0) | PAGE_BUSY;
+    atomic_store_explicit(&page->state, state, memory_order_release);
+    if (!rem) {
+        enqueue_fifo(&cold_list, page);
+        state = PAGE_SET_LIST(state, LIST_COLD);
+    }
+    page_busy_end(page, state);
+}
+
+// What the page counts for in dram_used. Call holding the page busy
+static uint64_t page_dram_bytes(struct tmem_page *page, uint32_t state) {
+#if TMEM_FINE == 1
+    return fine_dram_bytes(page);
+#else
+    return (state & PAGE_REM) ? 0 : page->size;
+#endif
+}
+
+// A recycled page if free_list has one, else a fresh one from the slabs.
+// gen is the generation to publish it in
+static struct tmem_page* page_alloc(uint32_t *gen) {
+    struct tmem_page *page = NULL;
+    if (free_list.numentries > 0) page = dequeue_fifo(&free_list);
+    if (page == NULL) {
+        *gen = 0;
+        return slab_alloc_page();
+    }
+    __atomic_fetch_sub(&SLAB_OF(page)->freed, 1, __ATOMIC_RELEASE);
+    // Stays PAGE_FREE, so nothing acts on it, until page_publish
+    uint32_t state = page_state(page);
+    assert(state & PAGE_FREE);
+    assert(page->cold->list == NULL);
+    *gen = (state & PAGE_GEN_MASK) + (1U << PAGE_GEN_SHIFT);
+    return page;
+}
+
+// Fills in the page for the chunk at va_start, length bytes of which are mapped
+static void page_setup(struct tmem_page *page, void *va_start, uint64_t length, int prot) {
+    page->va_start = va_start;
+    if (length < PAGE_SIZE) {
+        page->va = (uint64_t)(page->va_start);
+        page->size = length;
+        if (page->size < BASE_PAGE_SIZE) page->size = BASE_PAGE_SIZE;   // Always at least 4KB
+    } else {
+        page->size = PAGE_SIZE;
+        // va is the PAGE_SIZE aligned address inside the page, lookups go by va_start
+        page->va = PAGE_ROUND_UP((uint64_t)(page->va_start));
+    }
+    if (page->va > max_tmem_va) max_tmem_va = page->va;
+    if (page->va < min_tmem_va) min_tmem_va = page->va;
+    page->accesses = 0;
+    page->reads = 0;
+    page->writes = 0;
+    page->cold->idle_scans = 0;
+    page->cold->prot = prot;
+    page->local_clock = 0;
+#if CLUSTER_ALGO == 1
+    page->cold->cyc_accessed = 0;
+    page->cold->ip = 0;
+    memset(page->cold->neighbors, 0, MAX_NEIGHBORS * sizeof(struct neighbor_page));
+#endif
+    page->cold->prev = NULL;
+    page->cold->next = NULL;
+}
+
+// Lazy ranges. A PROT_NONE mapping or one of at least TMEM_LAZY_MIN bytes,
+// and the brk heap, is bound to the remote node and recorded as a range
+// instead of getting its pages up front. The page of a PAGE_SIZE chunk in it
+// is made the first time the chunk shows up accessed (find_or_create_page,
+// or lazy_scan for sources that only see tracked pages), and only then is
+// the chunk placed and counted in dram_used like an mmap of its own.
+// Readers walk the ranges without a lock inside an epoch section, that
+// walk is only a hint and ranges_lock is held to act on it. Ranges only
+// shrink or grow at their ends in place, one that's gone entirely is retired
+// through the epoch back to the free list. Entries are mapped
+// TMEM_RANGE_BATCH at a time and never given back, lockless readers may
+// still be on a released one
+struct tmem_range {
+    uint64_t base;              // address the mmap returned, chunks are PAGE_SIZE steps from it
+    uint64_t start, end;        // what's still mapped
+    int prot;
+    struct tmem_range *next;
+    struct epoch_entry retire;
+};
+
+static pthread_mutex_t ranges_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tmem_range *ranges = NULL;
+static struct tmem_range *range_block = NULL;   // the batch entries are carved from
+static uint64_t range_block_used = TMEM_RANGE_BATCH;
+static struct tmem_range *range_free = NULL;    // released entries
+
+// Call with ranges_lock held
+static struct tmem_range* range_alloc(void) {
+    struct tmem_range *r = range_free;
+    if (r != NULL) {
+        range_free = r->next;
+        return r;
+    }
+    if (range_block_used == TMEM_RANGE_BATCH) {
+        range_block = libc_mmap(NULL, TMEM_RANGE_BATCH * sizeof(struct tmem_range), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        assert(range_block != MAP_FAILED);
+        pebs_stats.internal_mem_overhead += TMEM_RANGE_BATCH * sizeof(struct tmem_range);
+        range_block_used = 0;
+    }
+    return &range_block[range_block_used++];
+}
+
+static struct tmem_range* range_of(struct epoch_entry *entry) {
+    return (struct tmem_range *)((char *)entry - offsetof(struct tmem_range, retire));
+}
+
+static void range_release(struct epoch_entry *entry) {
+    struct tmem_range *r = range_of(entry);
+    pthread_mutex_lock(&ranges_lock);
+    r->next = range_free;
+    range_free = r;
+    pthread_mutex_unlock(&ranges_lock);
+}
+
+// First range overlapping [start, end)
+static struct tmem_range* range_find(uint64_t start, uint64_t end) {
+    struct tmem_range *r = __atomic_load_n(&ranges, __ATOMIC_ACQUIRE);
+    while (r != NULL && (end <= __atomic_load_n(&r->start, __ATOMIC_RELAXED) || start >= __atomic_load_n(&r->end, __ATOMIC_RELAXED))) {
+        r = __atomic_load_n(&r->next, __ATOMIC_ACQUIRE);
+    }
+    return r;
+}
+
+// Records [start, end) as a lazy range whose chunks go from base. A range
+// with the same base and prot it continues is grown instead, so heap growth
+// and mprotect in steps don't pile up ranges. The caller binds the memory
+static void range_add(uint64_t base, uint64_t start, uint64_t end, int prot) {
+    pthread_mutex_lock(&ranges_lock);
+    for (struct tmem_range *r = ranges; r != NULL; r = r->next) {
+        if (r->base != base || r->prot != prot) continue;
+        if (r->end == start) {
+            __atomic_store_n(&r->end, end, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&ranges_lock);
+            return;
+        }
+        if (r->start == end) {
+            __atomic_store_n(&r->start, start, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&ranges_lock);
+            return;
+        }
+    }
+    struct tmem_range *r = range_alloc();
+    r->base = base;
+    r->start = start;
+    r->end = end;
+    r->prot = prot;
+    r->next = ranges;
+    __atomic_store_n(&ranges, r, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ranges_lock);
+    LOG_DEBUG("MMAP: lazy range 0x%lx - 0x%lx\n", start, end);
+}
+
+// Drops [start, end) from the lazy ranges
+static void range_remove(uint64_t start, uint64_t end) {
+    struct tmem_range *retired = NULL;    // chained through retire.next
+
+    pthread_mutex_lock(&ranges_lock);
+    struct tmem_range **pp = &ranges;
+    while (*pp != NULL) {
+        struct tmem_range *r = *pp;
+        if (end <= r->start || start >= r->end) {
+            pp = &r->next;
+            continue;
+        }
+        if (start <= r->start && end >= r->end) {
+            // Readers still on r go on through r->next, so it's left alone
+            __atomic_store_n(pp, r->next, __ATOMIC_RELEASE);
+            r->retire.next = retired != NULL ? &retired->retire : NULL;
+            retired = r;
+            continue;
+        }
+        if (start > r->start && end < r->end) {
+            // A hole in the middle, the part past it needs its own range
+            struct tmem_range *tail = range_alloc();
+            *tail = *r;
+            tail->start = end;
+            __atomic_store_n(&r->next, tail, __ATOMIC_RELEASE);
+            __atomic_store_n(&r->end, start, __ATOMIC_RELAXED);
+        } else if (start <= r->start) {
+            __atomic_store_n(&r->start, end, __ATOMIC_RELAXED);
+        } else {
+            __atomic_store_n(&r->end, start, __ATOMIC_RELAXED);
+        }
+        pp = &r->next;
+    }
+    pthread_mutex_unlock(&ranges_lock);
+
+    // range_release takes ranges_lock
+    while (retired != NULL) {
+        struct epoch_entry *next = retired->retire.next;
+        epoch_retire(&retired->retire, range_release);
+        retired = next != NULL ? range_of(next) : NULL;
+    }
+}
+
+// What's left of a lazy range's chunk around va once the pages already in
+// it are cut off
+struct chunk {
+    uint64_t va, start, end;
+};
+
+static void chunk_clamp(struct tmem_page *page, void *arg) {
+    struct chunk *chunk = arg;
+    uint64_t page_start = (uint64_t)page->va_start;
+    uint64_t page_end = page_start + page->size;
+    // Nothing covers va, so a page is either all below it or all above
+    if (page_end <= chunk->va) {
+        if (page_end > chunk->start) chunk->start = page_end;
+    } else if (page_start < chunk->end) {
+        chunk->end = page_start;
+    }
+}
+
+// Part of a lazy range, as taken out by range_take
+struct range_part {
+    uint64_t base, start, end;
+    int prot;
+};
+
+// Takes the parts of the lazy ranges in [start, end) out into *parts_out. That
+// has room for TMEM_RANGE_BATCH, more get a mapping of their own which
+// range_parts_free gives back. Ranges already at prot stay, -1 takes them
+// all. Returns how many were taken
+static int range_take(uint64_t start, uint64_t end, int prot, struct range_part **parts_out) {
+    int n = 0;
+    pthread_mutex_lock(&ranges_lock);
+    for (struct tmem_range *r = ranges; r != NULL; r = r->next) {
+        if (end <= r->start || start >= r->end || r->prot == prot) continue;
+        n++;
+    }
+    if (n > TMEM_RANGE_BATCH) {
+        *parts_out = libc_mmap(NULL, n * sizeof(struct range_part), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        assert(*parts_out != MAP_FAILED);
+    }
+    struct range_part *parts = *parts_out;
+    n = 0;
+    for (struct tmem_range *r = ranges; r != NULL; r = r->next) {
+        if (end <= r->start || start >= r->end || r->prot == prot) continue;
+        parts[n].base = r->base;
+        parts[n].start = start > r->start ? start : r->start;
+        parts[n].end = end < r->end ? end : r->end;
+        parts[n].prot = r->prot;
+        n++;
+    }
+    pthread_mutex_unlock(&ranges_lock);
+
+    for (int i = 0; i < n; i++) range_remove(parts[i].start, parts[i].end);
+    return n;
+}
+
+static void range_parts_free(struct range_part *parts, int n) {
+    if (n > TMEM_RANGE_BATCH) libc_munmap(parts, n * sizeof(struct range_part));
+}
+
+// Makes the page for the chunk of r holding va, cut to [lo, hi) as well.
+// Call with ranges_lock held, inside an epoch section
+static struct tmem_page* page_materialize(struct tmem_range *r, uint64_t va, uint64_t lo, uint64_t hi) {
+    struct chunk chunk = { .va = va };
+    chunk.start = r->base + (va - r->base) / PAGE_SIZE * PAGE_SIZE;
+    chunk.end = chunk.start + PAGE_SIZE;
+    if (chunk.start < lo) chunk.start = lo;
+    if (chunk.end > hi) chunk.end = hi;
+    // A grown heap or an mremap can leave pages inside the chunk
+    walk_pages(chunk.start, chunk.end, chunk_clamp, &chunk);
+    uint64_t start = chunk.start, end = chunk.end;
+    uint64_t length = end - start;
+
+    unsigned long dram_nodemask = 1UL << DRAM_NODE;
+    pthread_mutex_lock(&mmap_lock);
+    bool rem = __atomic_load_n(&dram_used, __ATOMIC_ACQUIRE) + length > dram_size
+        || atomic_load_explicit(&dram_lock, memory_order_acquire);
+    if (!rem) __atomic_fetch_add(&dram_used, length, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mmap_lock);
+
+    // Already bound to the remote node, DRAM chunks move whatever was faulted in
+    if (!rem && mbind((void *)start, length, MPOL_BIND, &dram_nodemask, 64, MPOL_MF_MOVE) == -1) {
+        perror("mbind");
+        __atomic_fetch_sub(&dram_used, length, __ATOMIC_RELEASE);
+        rem = true;
+    }
+
+    // No epoch_reclaim here, range_release would take ranges_lock again
+    uint32_t gen;
+    struct tmem_page *page = page_alloc(&gen);
+    page_setup(page, (void *)start, length, r->prot);
+#if TMEM_FINE == 1
+    fine_setup(page, rem);
+#endif
+    page_publish(page, gen, rem);
+    add_page(page);
+    pebs_stats.mem_allocated += page->size;
+    STAT_INC(pebs_stats.lazy_pages);
+    return page;
+}
+
+// find_page_no_lock, but an address in an untouched chunk of a lazy range
+// gets its page made. Call inside epoch_enter()/epoch_exit()
+struct tmem_page* find_or_create_page(uint64_t va) {
+    struct tmem_page *page = find_page_no_lock(va);
+    if (page != NULL || range_find(va, va + 1) == NULL) return page;
+
+    pthread_mutex_lock(&ranges_lock);
+    // munmap drops the range before the pages, so it can't miss one made here
+    struct tmem_range *r = range_find(va, va + 1);
+    page = find_page_no_lock(va);
+    if (page == NULL && r != NULL) page = page_materialize(r, va, r->start, r->end);
+    pthread_mutex_unlock(&ranges_lock);
+    return page;
+}
+
+// A PROT_NONE mapping is lazy for being inaccessible, so the part of one
+// made accessible is tracked like an mmap of its size
+static inline bool range_part_eager(int old_prot, int prot, uint64_t start, uint64_t end) {
+    return old_prot == PROT_NONE && prot != PROT_NONE && end - start < TMEM_LAZY_MIN;
+}
+
+// Gives the parts of the lazy ranges in [start, end) that range_part_eager
+// picks for prot their pages, chunk by chunk like find_or_create_page
+static void range_materialize(uint64_t start, uint64_t end, int prot) {
+    epoch_enter();
+    pthread_mutex_lock(&ranges_lock);
+    for (struct tmem_range *r = ranges; r != NULL; r = r->next) {
+        if (end <= r->start || start >= r->end) continue;
+        uint64_t lo = start > r->start ? start : r->start;
+        uint64_t hi = end < r->end ? end : r->end;
+        if (!range_part_eager(r->prot, prot, lo, hi)) continue;
+        for (uint64_t va = lo; va < hi;) {
+            struct tmem_page *page = find_page_no_lock(va);
+            if (page == NULL) page = page_materialize(r, va, lo, hi);
+            va = (uint64_t)page->va_start + page->size;
+        }
+    }
+    pthread_mutex_unlock(&ranges_lock);
+    epoch_exit();
+}
+
+// find_or_create_page for the base pages in [start, end) that pagemap_fd
+// (/proc/self/pagemap) shows present, so only lazy chunks with memory
+// faulted in get a page. Returns the pages made. Call inside
+// epoch_enter()/epoch_exit()
+size_t lazy_fault_in(int pagemap_fd, uint64_t start, uint64_t end) {
+    if (range_find(start, end) == NULL) return 0;
+
+    uint64_t entries[LAZY_SCAN_ENTRIES];
+    size_t made = 0;
+    uint64_t va = start & BASE_PAGE_MASK;
+    while (va < end) {
+        uint64_t n = (end - va + BASE_PAGE_SIZE - 1) / BASE_PAGE_SIZE;
+        if (n > LAZY_SCAN_ENTRIES) n = LAZY_SCAN_ENTRIES;
+        ssize_t got = pread(pagemap_fd, entries, n * sizeof(uint64_t), va / BASE_PAGE_SIZE * sizeof(uint64_t));
+        if (got <= 0) break;
+        n = got / sizeof(uint64_t);
+
+        uint64_t block = va, covered = va;
+        va += n * BASE_PAGE_SIZE;
+        for (uint64_t j = 0; j < n; j++) {
+            uint64_t a = block + j * BASE_PAGE_SIZE;
+            if (a < covered || !(entries[j] & PAGEMAP_PRESENT)) continue;
+            struct tmem_page *page = find_page_no_lock(a);
+            if (page == NULL && (page = find_or_create_page(a)) != NULL) made++;
+            // Memory outside the lazy ranges, or a range that went away meanwhile
+            if (page == NULL) continue;
+            covered = (uint64_t)page->va_start + page->size;
+        }
+        if (covered > va) va = covered;
+    }
+    return made;
+}
+
+// Makes the pages of lazy range chunks that have memory faulted in, for
+// sample sources that only look at tracked pages. Goes through up to max
+// chunks in address order from *cursor, which is left past the last one,
+// or at 0 once the ranges are done. pagemap_fd is /proc/self/pagemap.
+// Returns the pages made
+size_t lazy_scan(int pagemap_fd, uint64_t *cursor, size_t max) {
+    size_t made = 0;
+    for (size_t i = 0; i < max; i++) {
+        // The chunk at or after the cursor, ranges aren't kept in order
+        uint64_t start = UINT64_MAX, end = 0;
+        pthread_mutex_lock(&ranges_lock);
+        for (struct tmem_range *r = ranges; r != NULL; r = r->next) {
+            if (r->end <= *cursor) continue;
+            uint64_t va = *cursor > r->start ? *cursor : r->start;
+            if (va >= start) continue;
+            start = va;
+            end = r->base + ((va - r->base) / PAGE_SIZE + 1) * PAGE_SIZE;
+            if (end > r->end) end = r->end;
+        }
+        pthread_mutex_unlock(&ranges_lock);
+        if (start == UINT64_MAX) {
+            *cursor = 0;
+            break;
+        }
+        *cursor = end;
+
+        epoch_enter();
+        made += lazy_fault_in(pagemap_fd, start, end);
+        epoch_exit();
+    }
+    return made;
+}
+
 void tmem_init() {
     internal_call = true;
 #if (DRAM_BUFFER != 0 && DRAM_SIZE != 0) || (DRAM_BUFFER == 0 && DRAM_SIZE == 0)
@@ -96,22 +799,42 @@ void tmem_init() {
     internal_call = false;
 }
 
-#define PAGE_ROUND_UP(x) (((x) + (PAGE_SIZE)-1) & (~((PAGE_SIZE)-1)))
-#define PAGE_ROUND_DOWN(x) ((x) & (~((PAGE_SIZE)-1)))
 
-#define PAGE_ROUND_UP_BASE(x) (((x) + (BASE_PAGE_SIZE)-1) & (~((BASE_PAGE_SIZE)-1)))
+// Pages taken out of the index at a time
+#define MUNMAP_BATCH 256
 
+// Serializes the calls that hand an address range to new memory before
+// tmem is done with the old (mremap, brk) against mmaps that could get it
+static pthread_rwlock_t vma_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-void* tmem_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
-    length = PAGE_ROUND_UP_BASE(length);
-    internal_call = true;
+static void tmem_untrack(uint64_t start, uint64_t end);
 
+// Tracks the freshly mapped [p, p + length). A lazy one is recorded as a
+// range with its chunks going from base instead
+static void tmem_track(void *p, uint64_t length, int prot, bool lazy, uint64_t base) {
     unsigned long dram_nodemask = 1UL << DRAM_NODE;
     unsigned long rem_nodemask = 1UL << REM_NODE;
     void *p_dram = NULL, *p_rem = NULL;
 
-    void *p = libc_mmap(addr, length, prot, flags, fd, offset);
-    assert(p != MAP_FAILED);
+#if TMEM_FINE == 1
+    // move_pages of one base page of a THP moves all of it, so the bitmap
+    // and dram_used would only see a 512th. Fine mode keeps tracked memory
+    // in base pages
+    if (madvise(p, length, MADV_NOHUGEPAGE) == -1) {
+        perror("madvise");
+    }
+#endif
+
+    if (lazy) {
+        // Untouched chunks stay out of DRAM, page_materialize moves them if there's room
+        if (mbind(p, length, MPOL_BIND, &rem_nodemask, 64, 0) == -1) {
+            perror("mbind");
+            assert(0);
+        }
+        range_add(base, (uint64_t)p, (uint64_t)p + length, prot);
+        STAT_INC(pebs_stats.lazy_ranges);
+        return;
+    }
 
     pthread_mutex_lock(&mmap_lock);
 
@@ -165,166 +888,333 @@ void* tmem_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t of
     }
     
 
-
     // LOG_DEBUG("dram_size: %ld, dram_free: %ld\n", dram_size, dram_free);
-    if (p == MAP_FAILED) {
-        LOG_DEBUG("mmap failed\n");
-        return MAP_FAILED;
-    }
     pebs_stats.mem_allocated += length;
 
     assert((uint64_t)p % BASE_PAGE_SIZE == 0);
 
     // recycle pages from free_tmem_pages
+    epoch_reclaim();
     uint64_t num_tmem_pages_needed = (length + PAGE_SIZE - 1) / PAGE_SIZE;
-    uint64_t i = 0;
-    for (i = 0; free_list.numentries > 0 && num_tmem_pages_needed > 0; i++) {
-        // printf("recycling pages\n");
-        struct tmem_page *page = dequeue_fifo(&free_list);
-        if (page == NULL) break;
-        pthread_mutex_lock(&page->page_lock);
-
-        // use lock to cause atomic update of page
-        assert(page->free);
-        page->va_start = p + (i * PAGE_SIZE);
-        if (length - (i * PAGE_SIZE) < PAGE_SIZE) {
-            page->va = (uint64_t)(page->va_start);
-            page->size = length - (i * PAGE_SIZE);
-            if (page->size < BASE_PAGE_SIZE) page->size = BASE_PAGE_SIZE;   // Always at least 4KB
-        } else {
-            page->size = PAGE_SIZE;
-            // Align va to PAGE_SIZE address for future lookups in hashmap
-            page->va = PAGE_ROUND_UP((uint64_t)(page->va_start));
-        }
-        if (page->va > max_tmem_va) max_tmem_va = page->va;
-        if (page->va < min_tmem_va) min_tmem_va = page->va;
-        page->mig_up = 0;
-        page->mig_down = 0;
-        page->accesses = 0;
-        page->migrating = false;
-        page->local_clock = 0;
-        page->cyc_accessed = 0;
-        page->ip = 0;
-
-        // page->prev = NULL;
-        // page->next = NULL;
-
-
-        page->in_dram = (page->va_start >= p_rem) ? IN_REM : IN_DRAM;
-        page->hot = false;
-        page->free = false;
-        page->migrating = false;
-        page->migrated = false;
-        memset(page->neighbors, 0, MAX_NEIGHBORS * sizeof(struct neighbor_page));
-
-        assert(page->list == NULL);
-        if (page->in_dram == IN_DRAM) {
-            enqueue_fifo(&cold_list, page);
-        }
-
-        pthread_mutex_unlock(&page->page_lock);
-
-        // pthread_mutex_init(&page->page_lock, NULL);
+    for (uint64_t i = 0; i < num_tmem_pages_needed; i++) {
+        uint32_t gen;
+        struct tmem_page *page = page_alloc(&gen);
+        page_setup(page, p + (i * PAGE_SIZE), length - (i * PAGE_SIZE), prot);
+#if TMEM_FINE == 1
+        fine_setup(page, page->va_start >= p_rem);
+#endif
+        page_publish(page, gen, page->va_start >= p_rem);
 
-        // LOG_DEBUG("adding recycled page: 0x%lx\n", (uint64_t)page);
+        // LOG_DEBUG("adding page: 0x%lx\n", (uint64_t)page);
         add_page(page);
-        num_tmem_pages_needed--;
     }
+}
 
-    if (num_tmem_pages_needed == 0) {
-        internal_call = false; 
-        return p;
-    }
+void* tmem_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    length = PAGE_ROUND_UP_BASE(length);
+    internal_call = true;
 
-    uint64_t pages_mmap_size = num_tmem_pages_needed * sizeof(struct tmem_page);
-    void *pages_ptr = libc_mmap(NULL, pages_mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    assert(pages_ptr != MAP_FAILED);
-    pebs_stats.internal_mem_overhead += pages_mmap_size;
-    
-    for (uint64_t j = 0; num_tmem_pages_needed > 0; j++) {
-        // struct tmem_page* page = create_tmem_page(page_boundry, pages_ptr);
-        struct tmem_page *page = (struct tmem_page *)(pages_ptr + (j * sizeof(struct tmem_page)));
-
-        // Don't need lock since first creation of page so no threads have cached data on it
-        page->va_start = p + (i * PAGE_SIZE);
-        if (length - (i * PAGE_SIZE) < PAGE_SIZE) {
-            page->va = (uint64_t)(page->va_start);
-            page->size = length - (i * PAGE_SIZE);
-            if (page->size < BASE_PAGE_SIZE) page->size = BASE_PAGE_SIZE;   // Always at least 4KB
-        } else {
-            page->size = PAGE_SIZE;
-            // Align va to PAGE_SIZE address for future lookups in hashmap
-            page->va = PAGE_ROUND_UP((uint64_t)(page->va_start));
-        }
-        if (page->va > max_tmem_va) max_tmem_va = page->va;
-        if (page->va < min_tmem_va) min_tmem_va = page->va;
-        page->mig_up = 0;
-        page->mig_down = 0;
-        page->accesses = 0;
-        page->local_clock = 0;
-        page->cyc_accessed = 0;
-        page->ip = 0;
-
-        page->prev = NULL;
-        page->next = NULL;
-
-        page->in_dram = (page->va_start >= p_rem) ? IN_REM : IN_DRAM;
-        page->hot = false;
-        page->free = false;
-        page->migrating = false;
-        page->migrated = false;
-        memset(page->neighbors, 0, MAX_NEIGHBORS * sizeof(struct neighbor_page));
-        pthread_mutex_init(&page->page_lock, NULL);
-        page->list = NULL;
-        if (page->in_dram == IN_DRAM) {
-            enqueue_fifo(&cold_list, page);
-        }
+    pthread_rwlock_rdlock(&vma_lock);
+    // Whatever a MAP_FIXED mapping replaces is gone
+    if (flags & MAP_FIXED) tmem_untrack((uint64_t)addr, (uint64_t)addr + length);
 
-        
-        // LOG_DEBUG("adding page: 0x%lx\n", (uint64_t)page);
-        add_page(page);
-        num_tmem_pages_needed--;
-        i++;
-    }
+    void *p = libc_mmap(addr, length, prot, flags, fd, offset);
+    assert(p != MAP_FAILED);
+
+    // Reservations get their pages as they're used
+    tmem_track(p, length, prot, prot == PROT_NONE || length >= TMEM_LAZY_MIN, (uint64_t)p);
+    pthread_rwlock_unlock(&vma_lock);
     internal_call = false;
     return p;
 }
 
+// Gives the part of page between start and end a page of its own at start
+// + delta, with the same tier and counts. Call holding the page busy so its
+// tier can't change under it
+static void page_split(struct tmem_page *page, uint32_t state, uint64_t start, uint64_t end, int64_t delta) {
+    uint32_t gen;
+    struct tmem_page *piece = page_alloc(&gen);
+    page_setup(piece, (void *)(start + delta), end - start, page->cold->prot);
+    piece->accesses = page->accesses;
+    piece->reads = page->reads;
+    piece->writes = page->writes;
+    piece->local_clock = page->local_clock;
+#if TMEM_FINE == 1
+    fine_copy(piece, page, (start - (uint64_t)page->va_start) / BASE_PAGE_SIZE);
+#endif
+    page_publish(piece, gen, state & PAGE_REM);
+    add_page(piece);
+    pebs_stats.mem_allocated += piece->size;
+    __atomic_fetch_add(&dram_used, page_dram_bytes(piece, state), __ATOMIC_RELEASE);
+}
+
+// Takes the pages overlapping [start, end) out of the index and frees them.
+// What of them lies outside the range is tracked on, and with move set what
+// lies inside is tracked again delta bytes away
+static void pages_release(uint64_t start, uint64_t end, bool move, int64_t delta) {
+    struct tmem_page *pages[MUNMAP_BATCH];
+    struct epoch_entry *retire[MUNMAP_BATCH];
+    uint64_t next = start;
+    size_t n;
+    do {
+        n = remove_pages(&next, end, pages, MUNMAP_BATCH);
+        size_t num_retire = 0;
+        for (size_t i = 0; i < n; i++) {
+            struct tmem_page *page = pages[i];
+            uint32_t state;
+            // Waits out a migration in flight. Only the munmap that took it
+            // out of the index frees it, so it can't be free here
+            if (!page_busy_begin(page, PAGE_MIGRATING, &state)) continue;
+
+            uint64_t page_start = (uint64_t)page->va_start;
+            uint64_t page_end = page_start + page->size;
+            if (page_start < start) page_split(page, state, page_start, start, 0);
+            if (page_end > end) page_split(page, state, end, page_end, 0);
+            if (move) {
+                page_split(page, state, page_start > start ? page_start : start,
+                           page_end < end ? page_end : end, delta);
+            }
+
+            pebs_stats.mem_allocated -= page->size;
+            __atomic_fetch_sub(&dram_used, page_dram_bytes(page, state), __ATOMIC_RELEASE);
+            if (page->cold->list != NULL) {
+                page_list_remove_page(page->cold->list, page);
+            }
+            page_busy_end(page, PAGE_SET_LIST(state, LIST_NONE) | PAGE_FREE);
+            retire[num_retire++] = &page->cold->retire;
+        }
+        // Lookups may still hold the pages, they go on the free list after they finish
+        epoch_retire_batch(retire, num_retire, recycle_page);
+    } while (n == MUNMAP_BATCH);
+
+#if SAMPLE_SOURCE == SOURCE_HINT
+    // The pages are free, nothing arms them again
+    hint_untrack(start, end);
+#endif
+}
+
+// Stops tracking [start, end), whatever is left mapped of a partly
+// covered page is tracked on
+static void tmem_untrack(uint64_t start, uint64_t end) {
+    range_remove(start, end);
+    pages_release(start, end, false, 0);
+
+#if CLUSTER_ALGO == 0
+    if (__atomic_load_n(&free_list.numentries, __ATOMIC_ACQUIRE) > TMEM_FREE_HIGH) slab_trim();
+#endif
+}
+
 int tmem_munmap(void *addr, size_t length) {
     internal_call = true;
     LOG_DEBUG("tmem_munmap: %p, length: %lu\n", addr, length);
     LOG_DEBUG("tmem va range: 0x%lx - 0x%lx\n", min_tmem_va, max_tmem_va);
 
-    uint64_t num_tmem_pages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint64_t i = 0; i < num_tmem_pages; i++) {
-        void *va_start = addr + (i * PAGE_SIZE);
-        uint64_t va;
-        if (length - (i * PAGE_SIZE) < PAGE_SIZE) {
-            va = (uint64_t)(va_start);
-        } else {
-            va = PAGE_ROUND_UP((uint64_t)(va_start));
-        }
-        struct tmem_page *page = find_page(va);
-        if (page != NULL) {
-            pthread_mutex_lock(&page->page_lock);
-            assert(page->free == false);
-            page->free = true;
-            remove_page(page);
-            // if (page->in_dram == IN_DRAM) {
-            //     dram_used -= page->size;
-            // }
-            pebs_stats.mem_allocated -= page->size;
+    uint64_t start = (uint64_t)addr;
+    tmem_untrack(start, start + PAGE_ROUND_UP_BASE(length));
+    internal_call = false;
+    return 0;
+}
 
-            if (page->list != NULL) {
-                page_list_remove_page(page->list, page);
-            }
-            enqueue_fifo(&free_list, page);
+// The calls below run the syscall themselves, so the metadata only changes
+// once the kernel did, and return what it returned
+
+static void page_prot(struct tmem_page *page, void *arg) {
+    *(int *)arg = page->cold->prot;
+}
 
-            pthread_mutex_unlock(&page->page_lock);
+// Pages keep their tier and counts when mremap moves them, the memory
+// policy moves with the memory. A grown tail of tracked memory is tracked
+// like an mmap of its own, or grows the lazy range it continues
+long tmem_mremap(void *old_address, size_t old_size, size_t new_size, int flags, void *new_address) {
+    internal_call = true;
+    uint64_t old_start = (uint64_t)old_address;
+    old_size = PAGE_ROUND_UP_BASE(old_size);
+    new_size = PAGE_ROUND_UP_BASE(new_size);
+    uint64_t old_end = old_start + old_size;
+
+    pthread_rwlock_wrlock(&vma_lock);
+    // An mremap of a shared mapping that only duplicates it
+    if (old_size == 0) {
+        long ret = syscall_no_intercept(SYS_mremap, old_address, old_size, new_size, flags, new_address);
+        pthread_rwlock_unlock(&vma_lock);
+        internal_call = false;
+        return ret;
+    }
+
+    int prot = -1;
+    uint64_t base = 0;
+    epoch_enter();
+    walk_pages(old_start, old_end, page_prot, &prot);
+    struct tmem_range *r = range_find(old_start, old_end);
+    if (prot == -1 && r != NULL) prot = r->prot;
+    struct tmem_range *last = range_find(old_end - 1, old_end);
+    if (last != NULL) base = last->base;
+    epoch_exit();
+
+    long ret = syscall_no_intercept(SYS_mremap, old_address, old_size, new_size, flags, new_address);
+    if (syscall_error_code(ret) != 0) {
+        pthread_rwlock_unlock(&vma_lock);
+        internal_call = false;
+        return ret;
+    }
+
+    // Untracked memory has nothing to move, this is cheap then
+    uint64_t new_start = (uint64_t)ret;
+    int64_t delta = new_start - old_start;
+    uint64_t kept = old_size < new_size ? old_size : new_size;
+    if (new_size < old_size) tmem_untrack(old_start + new_size, old_start + old_size);
+    if (delta != 0) {
+        struct range_part local[TMEM_RANGE_BATCH], *parts = local;
+        int num_parts = range_take(old_start, old_start + kept, -1, &parts);
+        if (flags & MREMAP_FIXED) tmem_untrack(new_start, new_start + new_size);
+        pages_release(old_start, old_start + kept, true, delta);
+        // After the pages, so a chunk isn't made where one is about to land
+        for (int i = 0; i < num_parts; i++) {
+            range_add(parts[i].base + delta, parts[i].start + delta, parts[i].end + delta, parts[i].prot);
         }
+        range_parts_free(parts, num_parts);
+    }
+    if (new_size > old_size && prot != -1) {
+        uint64_t tail = new_start + old_size;
+        uint64_t length = new_size - old_size;
+        // prot can be the mark of a page with mixed protections, so only a
+        // lazy range or the size makes the tail lazy
+        bool lazy = last != NULL || length >= TMEM_LAZY_MIN;
+        tmem_track((void *)tail, length, prot, lazy, last != NULL ? base + delta : tail);
+    }
+    if (prot != -1) STAT_INC(pebs_stats.mremaps);
+    LOG_DEBUG("MREMAP: 0x%lx (%lu) -> 0x%lx (%lu)\n", old_start, old_size, new_start, new_size);
+
+    pthread_rwlock_unlock(&vma_lock);
+    internal_call = false;
+    return ret;
+}
+
+// Range handed to a walk_pages callback
+struct span {
+    uint64_t start, end;
+    int prot;
+};
+
+// The memory of a DRAM page the span covers entirely was dropped, so it
+// stops counting as DRAM. It's bound to the remote node, what's faulted back
+// in lands there until a hot request brings it back
+static void page_forget(struct tmem_page *page, void *arg) {
+    struct span *span = arg;
+    uint64_t page_start = (uint64_t)page->va_start;
+    if (page_start < span->start || page_start + page->size > span->end) return;
+
+    uint32_t state;
+    if (!page_busy_begin(page, PAGE_MIGRATING, &state)) return;
+    uint64_t bytes = page_dram_bytes(page, state);
+    if (bytes == 0) {
+        page_busy_end(page, state);
+        return;
+    }
+
+    unsigned long rem_nodemask = 1UL << REM_NODE;
+    if (mbind(page->va_start, page->size, MPOL_BIND, &rem_nodemask, 64, 0) == -1) {
+        perror("mbind");
+        page_busy_end(page, state);
+        return;
+    }
+    if (page->cold->list != NULL) {
+        page_list_remove_page(page->cold->list, page);
+    }
+#if TMEM_FINE == 1
+    fine_setup(page, true);
+#endif
+    __atomic_fetch_sub(&dram_used, bytes, __ATOMIC_RELEASE);
+    page_busy_end(page, (PAGE_SET_LIST(state, LIST_NONE) | PAGE_REM) & ~PAGE_HOT);
+    STAT_INC(pebs_stats.madvise_drops);
+}
+
+// MADV_DONTNEED and MADV_REMOVE drop the DRAM pages the range covers
+// entirely. Partly covered ones keep the rest of their memory and stay as
+// they are. MADV_FREE isn't a drop, the kernel only reclaims the memory
+// under pressure and a write keeps it
+long tmem_madvise(void *addr, size_t length, int advice) {
+    internal_call = true;
+    long ret = syscall_no_intercept(SYS_madvise, addr, length, advice);
+    if (syscall_error_code(ret) == 0 && (advice == MADV_DONTNEED || advice == MADV_REMOVE)) {
+        struct span span = { (uint64_t)addr, (uint64_t)addr + PAGE_ROUND_UP_BASE(length), 0 };
+        epoch_enter();
+        walk_pages(span.start, span.end, page_forget, &span);
+        epoch_exit();
     }
     internal_call = false;
-    return 0;
+    return ret;
+}
+
+// A page the span only partly covers has mixed protections now, it's
+// marked PROT_NONE so hinting faults leave it alone
+static void page_set_prot(struct tmem_page *page, void *arg) {
+    struct span *span = arg;
+    uint32_t state;
+    if (!page_busy_begin(page, 0, &state)) return;
+    uint64_t page_start = (uint64_t)page->va_start;
+    if (page_start >= span->start && page_start + page->size <= span->end) {
+        page->cold->prot = span->prot;
+    } else if (page->cold->prot != span->prot) {
+        page->cold->prot = PROT_NONE;
+    }
+    page_busy_end(page, state);
+}
+
+// Pages and lazy ranges take the new protection once the kernel did. A
+// page armed for a hinting fault stays write protected through it. What
+// range_part_eager picks of a PROT_NONE range gets its pages before the
+// range is dropped, so lookups always find one or the other
+long tmem_mprotect(void *addr, size_t length, int prot) {
+    internal_call = true;
+    long ret = syscall_no_intercept(SYS_mprotect, addr, length, prot);
+    if (syscall_error_code(ret) != 0) {
+        internal_call = false;
+        return ret;
+    }
+
+    struct span span = { (uint64_t)addr, (uint64_t)addr + PAGE_ROUND_UP_BASE(length), prot };
+    range_materialize(span.start, span.end, prot);
+    epoch_enter();
+    walk_pages(span.start, span.end, page_set_prot, &span);
+    epoch_exit();
+
+    struct range_part local[TMEM_RANGE_BATCH], *parts = local;
+    int num_parts = range_take(span.start, span.end, prot, &parts);
+    for (int i = 0; i < num_parts; i++) {
+        if (range_part_eager(parts[i].prot, prot, parts[i].start, parts[i].end)) continue;
+        range_add(parts[i].base, parts[i].start, parts[i].end, prot);
+    }
+    range_parts_free(parts, num_parts);
+    STAT_INC(pebs_stats.mprotects);
+    internal_call = false;
+    return ret;
+}
+
+// The brk heap from the first break seen on. It's a lazy range whose
+// chunks go from heap_base, every growth extends it
+static uint64_t heap_base = 0;
+static uint64_t heap_end = 0;
+
+long tmem_brk(void *addr) {
+    internal_call = true;
+    pthread_rwlock_wrlock(&vma_lock);
+    // Returns the break, the old one if it couldn't be moved
+    long ret = syscall_no_intercept(SYS_brk, addr);
+    uint64_t old_end = PAGE_ROUND_UP_BASE(heap_end);
+    uint64_t new_end = PAGE_ROUND_UP_BASE((uint64_t)ret);
+    if (heap_end == 0) {
+        heap_base = PAGE_ROUND_DOWN(new_end);
+    } else if (new_end > old_end) {
+        tmem_track((void *)old_end, new_end - old_end, PROT_READ | PROT_WRITE, true, heap_base);
+        STAT_INC(pebs_stats.heap_grows);
+    } else if (new_end < old_end) {
+        tmem_untrack(new_end, old_end);
+    }
+    heap_end = ret;
+    pthread_rwlock_unlock(&vma_lock);
+    internal_call = false;
+    return ret;
 }
 
 void tmem_cleanup() {
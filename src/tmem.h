@@ -6,7 +6,7 @@
 #include <numaif.h>
 
 #include "pebs.h"
-#include "uthash.h"
+#include "epoch.h"
 #include "algorithm.h"
 
 // #define DRAM_SIZE (14 * (1024UL * 1024UL * 1024UL))
@@ -23,9 +23,14 @@
 // #define PAGE_SIZE (256 * 1024UL) // 256KB
 #define BASE_PAGE_SIZE 4096UL
 
+#define PAGE_SHIFT (__builtin_ctzl(PAGE_SIZE))
 #define PAGE_MASK (~(PAGE_SIZE - 1))
 #define BASE_PAGE_MASK (~(BASE_PAGE_SIZE - 1))
 
+// /proc/self/pagemap entry bits, one entry per base page
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_PFN_MASK ((1ULL << 55) - 1)
+
 // Use either DRAM_BUFFER or DRAM_SIZE
 #ifndef DRAM_BUFFER 
 #define DRAM_BUFFER (1 * 1024L * 1024L * 1024L)     // How much to leave available on DRAM node
@@ -48,53 +53,245 @@ extern long rem_used;
 extern pthread_mutex_t mmap_lock;
 extern _Atomic bool dram_lock;
 
-enum {
-    IN_DRAM,
-    IN_REM
-};
+// Page metadata slabs, see slab_refill in tmem.c
+#ifndef TMEM_SLAB_SIZE
+#define TMEM_SLAB_SIZE (2 * 1024UL * 1024UL)
+#endif
+#ifndef TMEM_SLAB_BATCH
+#define TMEM_SLAB_BATCH 64      // pages a thread takes from the shared slab at once
+#endif
+#ifndef TMEM_FREE_HIGH
+#define TMEM_FREE_HIGH 65536    // freed pages kept for recycling before slabs are given back
+#endif
+
+// Lazy ranges, see find_or_create_page in tmem.c
+#ifndef TMEM_LAZY_MIN
+#define TMEM_LAZY_MIN (1024UL * 1024UL * 1024UL)    // mappings this big or PROT_NONE get pages on demand
+#endif
+#ifndef TMEM_RANGE_BATCH
+#define TMEM_RANGE_BATCH 64     // lazy range entries mapped at once, more are mapped as they run out
+#endif
+#ifndef TMEM_LAZY_SCAN
+#define TMEM_LAZY_SCAN 1024     // lazy chunks the idle and hint sources check for faulted in memory per scan
+#endif
+#define LAZY_SCAN_ENTRIES 512   // pagemap entries lazy_fault_in reads at once
 
 #ifndef MAX_NEIGHBORS
 #define MAX_NEIGHBORS 4
 #endif
 
+// Base page tracking inside each page, see fine.c
+#ifndef TMEM_FINE
+#define TMEM_FINE 0
+#endif
+#ifndef FINE_HOT_THRESHOLD
+#define FINE_HOT_THRESHOLD 1    // samples that put a base page in its page's promotion
+#endif
+#define FINE_PAGES (PAGE_SIZE / BASE_PAGE_SIZE)
+#define FINE_WORDS ((FINE_PAGES + 63) / 64)
+#if TMEM_FINE == 1 && PAGE_SIZE <= BASE_PAGE_SIZE
+#error "TMEM_FINE needs PAGE_SIZE bigger than BASE_PAGE_SIZE"
+#endif
+
+// Malloc arenas, see tmalloc.c
+#ifndef TMEM_MALLOC
+#define TMEM_MALLOC 0
+#endif
+#ifndef TMALLOC_RESERVE
+#define TMALLOC_RESERVE (64UL * 1024UL * 1024UL * 1024UL)  // address space the arenas are carved from
+#endif
+#ifndef TMALLOC_MAX
+#define TMALLOC_MAX (128 * 1024UL)      // bigger allocations go to libc, which mmaps them
+#endif
+#ifndef TMALLOC_EXTENT_CACHE
+#define TMALLOC_EXTENT_CACHE 4          // empty extents kept committed
+#endif
+
 struct tmem_page;
 
+struct tmem_fine {
+    uint8_t counts[FINE_PAGES];     // samples per base page, saturating, cooled with the page
+    uint64_t dram[FINE_WORDS];      // base pages counted in dram_used
+    bool pending;                   // page is in DRAM but a hot base page isn't
+};
+
 struct neighbor_page {
     struct tmem_page *page;
     double distance;
     uint64_t time_diff;
 };
 
+// Page metadata is split in two. struct tmem_page holds what a lookup and
+// a sample touch and is exactly one cache line, the rest lives in struct
+// tmem_page_cold, only touched on list moves, migration and munmap (and by
+// samples for the base page counts with TMEM_FINE). Both are carved from
+// dense arrays in the metadata slabs and a page keeps its cold half when
+// it's recycled
+struct tmem_page_cold {
+    struct tmem_page *page;         // owning page
+    struct tmem_page *next, *prev;
+    struct fifo_list *list;
+    struct epoch_entry retire;
+    uint64_t mig_start;
+    uint32_t idle_scans;    // consecutive idle page scans that found it untouched
+    int prot;               // as mapped, hinting faults only arm writable pages
+#if CLUSTER_ALGO == 1
+    uint64_t cyc_accessed;
+    uint64_t ip;
+    struct neighbor_page neighbors[MAX_NEIGHBORS];
+#endif
+#if TMEM_FINE == 1
+    struct tmem_fine fine;
+#endif
+};
+
 struct tmem_page {
     uint64_t va;
     void* va_start;
-    uint64_t size;
-    uint64_t mig_up, mig_down;
-    uint64_t accesses;
-    uint64_t local_clock;
-    uint64_t cyc_accessed;
-    uint64_t ip;
-    uint64_t mig_start;
-    pthread_mutex_t page_lock;
+    struct tmem_page *index_next;   // next page in the same page index slot
+    struct tmem_page_cold *cold;
+    uint64_t accesses;      // samples, or stall cycles with PEBS_WEIGHTED_HOTNESS
+    uint64_t local_clock;   // PAGE_STAMP of the clock/period shift accesses is scaled to
+    uint32_t size;          // never more than PAGE_SIZE
+    uint32_t reads, writes; // load/store samples, cooled with accesses
 
-    UT_hash_handle hh;
-    struct tmem_page *next, *prev;
-    struct neighbor_page neighbors[MAX_NEIGHBORS];
-    struct fifo_list *list;
+    _Atomic uint32_t state; // PAGE_* bits, see below
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct tmem_page) == 64, "struct tmem_page should fit one cache line");
 
-    // Page states
-    _Atomic uint8_t in_dram;
-    _Atomic bool hot;
-    _Atomic bool free;
-    _Atomic bool migrating;
-    _Atomic bool migrated;
+// Page state word. Every state change is a CAS on it, so the scanners
+// never block on a page and the migrate thread validates a page with one
+// load. The rules, see scripts/documentation.md for the races they cover:
+// - PAGE_BUSY is held by whoever changes the page's list links, only
+//   around the list operations, and nobody else changes the word meanwhile
+// - PAGE_MIGRATING is held by the migrate thread from validating a page it
+//   dequeued until it's done with it. The page is then on no list and only
+//   the migrate thread moves it, others may still flip PAGE_HOT
+// - munmap waits out both before setting PAGE_FREE, and the generation is
+//   bumped when a freed page is recycled
+#define PAGE_REM        (1U << 0)   // tier, clear when in DRAM
+#define PAGE_HOT        (1U << 1)
+#define PAGE_FREE       (1U << 2)
+#define PAGE_MIGRATING  (1U << 3)
+#define PAGE_MIGRATED   (1U << 4)
+#define PAGE_BUSY       (1U << 5)
+#define PAGE_LIST_SHIFT 6           // list it's on, as last set by a PAGE_BUSY holder
+#define PAGE_LIST_MASK  (3U << PAGE_LIST_SHIFT)
+#define PAGE_GEN_SHIFT  8
+#define PAGE_GEN_MASK   (~0U << PAGE_GEN_SHIFT)
+
+enum {
+    LIST_NONE,
+    LIST_HOT,
+    LIST_COLD,
+    LIST_FREE
 };
 
+#define PAGE_LIST(state) (((state) & PAGE_LIST_MASK) >> PAGE_LIST_SHIFT)
+#define PAGE_SET_LIST(state, l) (((state) & ~PAGE_LIST_MASK) | ((uint32_t)(l) << PAGE_LIST_SHIFT))
+
+static inline uint32_t page_state(struct tmem_page *page) {
+    return atomic_load_explicit(&page->state, memory_order_acquire);
+}
+
+static inline bool page_in_dram(struct tmem_page *page) {
+    return !(page_state(page) & PAGE_REM);
+}
+
+static inline bool page_is_free(struct tmem_page *page) {
+    return page_state(page) & PAGE_FREE;
+}
+
+// Clears then sets bits in the word. Returns false if the page is free,
+// spins while another thread has it busy
+static inline bool page_state_set(struct tmem_page *page, uint32_t bits, uint32_t clear) {
+    uint32_t state = page_state(page);
+    while (true) {
+        if (state & PAGE_FREE) return false;
+        if (state & PAGE_BUSY) {
+            __builtin_ia32_pause();
+            state = page_state(page);
+            continue;
+        }
+        uint32_t next = (state & ~clear) | bits;
+        if (next == state) return true;
+        if (atomic_compare_exchange_weak_explicit(&page->state, &state, next,
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            return true;
+        }
+    }
+}
+
+// Takes PAGE_BUSY once the page is neither busy nor in any of the wait
+// states. Returns false without it if the page is free. *state is the word
+// as taken, PAGE_BUSY included
+static inline bool page_busy_begin(struct tmem_page *page, uint32_t wait, uint32_t *state) {
+    uint32_t cur = page_state(page);
+    while (true) {
+        if (cur & PAGE_FREE) return false;
+        if (cur & (PAGE_BUSY | wait)) {
+            __builtin_ia32_pause();
+            cur = page_state(page);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&page->state, &cur, cur | PAGE_BUSY,
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            *state = cur | PAGE_BUSY;
+            return true;
+        }
+    }
+}
+
+// Publishes the word and drops PAGE_BUSY
+static inline void page_busy_end(struct tmem_page *page, uint32_t state) {
+    atomic_store_explicit(&page->state, state & ~PAGE_BUSY, memory_order_release);
+}
+
+// Which list the page's links say it's on, only stable under PAGE_BUSY or
+// PAGE_MIGRATING
+static inline uint32_t page_list_id(struct tmem_page *page) {
+    struct fifo_list *list = page->cold->list;
+    if (list == &hot_list) return LIST_HOT;
+    if (list == &cold_list) return LIST_COLD;
+    if (list == &free_list) return LIST_FREE;
+    return LIST_NONE;
+}
+
+// More store than load samples
+#define PAGE_WRITE_HOT(page) ((page)->writes > (page)->reads)
+
 void tmem_init();
 void* tmem_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 int tmem_munmap(void *addr, size_t length);
+long tmem_mremap(void *old_address, size_t old_size, size_t new_size, int flags, void *new_address);
+long tmem_madvise(void *addr, size_t length, int advice);
+long tmem_mprotect(void *addr, size_t length, int prot);
+long tmem_brk(void *addr);
 void tmem_cleanup();
 struct tmem_page* find_page(uint64_t va);
 struct tmem_page* find_page_no_lock(uint64_t va);
+struct tmem_page* find_or_create_page(uint64_t va);
+size_t snapshot_pages(uint64_t *buf, size_t max);
+size_t lazy_fault_in(int pagemap_fd, uint64_t start, uint64_t end);
+size_t lazy_scan(int pagemap_fd, uint64_t *cursor, size_t max);
+
+#if TMEM_MALLOC == 1
+void tmalloc_init(void);
+#endif
+
+#if TMEM_FINE == 1
+void fine_setup(struct tmem_page *page, bool rem);
+void fine_copy(struct tmem_page *dst, struct tmem_page *src, uint64_t first);
+uint64_t fine_dram_bytes(struct tmem_page *page);
+void fine_touch(struct tmem_page *page, uint64_t addr, uint64_t count);
+void fine_cool(struct tmem_page *page, int shift);
+uint64_t fine_promote_bytes(struct tmem_page *page);
+bool fine_migrate(struct tmem_page *page, int node, uint64_t *bytes);
+
+static inline bool fine_pending(struct tmem_page *page) {
+    return __atomic_load_n(&page->cold->fine.pending, __ATOMIC_ACQUIRE);
+}
+#endif
 
 #endif
\ No newline at end of file